@@ -1062,8 +1062,52 @@ class OpenAIEmbedding1M(DatasetCompetitionFormat):
         return f"{self.__class__.__name__}-{self.nb}"
 
 
+class SyntheticDataset(Dataset):
+    """
+    Small Gaussian mixture with some exact duplicates, generated locally. Used by
+    scripts/run_synthetic.sh to compare the I/O options on a tree without the
+    100M datasets.
+    """
+    def __init__(self, d=32):
+        self.basedir = os.path.join(BASEDIR, "synthetic")
+        self.d = d
+        self.nb = 200001
+        self.ds_fn = "base.%dd.fbin" % d
+
+    def prepare(self, skip_data=False):
+        os.makedirs(self.basedir, exist_ok=True)
+        if skip_data:
+            return
+        outfile = os.path.join(self.basedir, self.ds_fn)
+        if os.path.exists(outfile):
+            print("file %s already exists" % outfile)
+            return
+        rng = np.random.default_rng(7)
+        centers = rng.normal(0, 10, (300, self.d)).astype(np.float32)
+        lab = rng.integers(0, 300, self.nb)
+        x = (centers[lab] + rng.normal(0, 3, (self.nb, self.d))).astype(np.float32)
+        dup = rng.integers(0, self.nb, 5000)
+        x[rng.integers(0, self.nb, 5000)] = x[dup]
+        with open(outfile, "wb") as f:
+            np.array([self.nb, self.d], dtype=np.uint32).tofile(f)
+            x.tofile(f)
+        # neighbors of the sampled ids (every 100000th point), the gt of the configs
+        for r in [450.0, 2500.0]:
+            s = 0
+            for i in range(0, self.nb, 100000):
+                s += int((((x - x[i]) ** 2).sum(1) < r).sum()) - 1
+            print("radius %g: gt %d" % (r, s))
+
+    def get_dataset_fn(self):
+        return os.path.join(self.basedir, self.ds_fn)
+
+    def distance(self):
+        return "euclidean"
+
 
 DATASETS = {
+    'synthetic-32d': lambda : SyntheticDataset(32),
+
     'bigann-1B': lambda : BigANNDataset(1000),
     'bigann-100M': lambda : BigANNDataset(100),
     'bigann-10M': lambda : BigANNDataset(10),
@@ -3,33 +3,60 @@
 #include "../utils/utils.h"
 #include "../utils/heap.h"
 #include "string.h"
+#include <map>
+#include <algorithm>
 
+// Cache over a page aligned arena in which every cluster takes just the pages it needs:
+// free space is kept as extents of pages, allocated first fit and merged when freed.
+// Clusters are read straight into their extent and used in place: find and push hand out
+// the extent pinned, and a pinned cluster is not evicted until release, so the clusters of
+// the current target stay put.
+//
+// Eviction is Belady made size aware: a missing cluster needs a contiguous run of pages, so
+// each of the unpinned clusters used furthest in the future is grown into a run with its
+// free and evictable neighbours, and the run holding the most page x time per page until
+// next use goes first. A cluster is only admitted while its victims hold more than it would and are
+// all used after it.
 struct Cache {
+    static const size_t CANDIDATES = 8;
+
     size_t budget;
     size_t size;
-    size_t length;
-    float* data;
+    char* data;
 
     size_t filled;
     size_t hit;
     size_t total;
+    size_t now;
     updateable_heap<size_t, size_t, std::greater<size_t>> priority;
     std::vector<int> address_table;
+    std::vector<size_t> pages;
     std::vector<size_t> ptr;
     std::vector<std::vector<size_t>> iters;
+    std::vector<unsigned> pins;
+    std::vector<size_t> pinned;
+    std::vector<std::pair<size_t, size_t>> held;
+    std::map<size_t, size_t> free_extents;
+    std::map<size_t, size_t> used_extents;
+    std::vector<size_t> run;
+    std::vector<size_t> best_run;
 
-    Cache(size_t budget, size_t length): budget(budget), length(length) {
-        size = budget / 4 / length;
-        data = new float[length * size];
-        priority = updateable_heap<size_t, size_t, std::greater<size_t>>(size + 1);
+    Cache(size_t budget): budget(budget) {
+        size = budget / PAGE_SIZE;
+        data = (char*)aligned_alloc(PAGE_SIZE, size * PAGE_SIZE);
+        if (size > 0) free_extents[0] = size;
         filled = 0;
         hit = 0;
         total = 0;
+        now = 0;
     }
 
     void init(std::vector<std::vector<size_t>> tasks, size_t n = 0) {
         if (n == 0) n = tasks.size();
         address_table = std::vector<int>(n, -1);
+        priority = updateable_heap<size_t, size_t, std::greater<size_t>>(n + 1);
+        pages.assign(n, 0);
+        pins.assign(n, 0);
         ptr.resize(n);
         iters.resize(n);
         size_t num = 0;
@@ -41,33 +68,196 @@ struct Cache {
         for (size_t i = 0; i < n; i++) iters[i].push_back(std::numeric_limits<size_t>::max());
     }
 
-    inline bool find(size_t id, float* buffer, unsigned bucket_length) {
+    inline char* pin(size_t id) {
+        pins[id]++;
+        pinned.push_back(id);
+        return data + address_table[id] * PAGE_SIZE;
+    }
+
+    // the extent holding the cluster, or nullptr if it is not cached
+    inline char* find(size_t id) {
         total++;
+        now++;
         ptr[id]++;
-        if (address_table[id] == -1) return false;
+        if (address_table[id] == -1) return nullptr;
         hit++;
         priority.update(std::make_pair(id, iters[id][ptr[id]]));
-        memcpy(buffer, data + address_table[id] * length, bucket_length * sizeof(float));
+        return pin(id);
+    }
+
+    inline bool contains(size_t id) {
+        return address_table[id] != -1;
+    }
+
+    // the task was served without touching the cluster, only advance its next use
+    inline void skip(size_t id) {
+        now++;
+        ptr[id]++;
+        if (address_table[id] != -1) priority.update(std::make_pair(id, iters[id][ptr[id]]));
+    }
+
+    // page x time a cluster holds until its next use
+    inline double weight(size_t next, size_t n) {
+        return (double)(next - now) * n;
+    }
+
+    // first fit, -1 if no extent is large enough
+    int allocate(size_t n) {
+        for (auto it = free_extents.begin(); it != free_extents.end(); ++it) {
+            if (it->second < n) continue;
+            size_t start = it->first, len = it->second;
+            free_extents.erase(it);
+            if (len > n) free_extents[start + n] = len - n;
+            filled += n;
+            return start;
+        }
+        return -1;
+    }
+
+    void deallocate(size_t start, size_t n) {
+        filled -= n;
+        auto next = free_extents.lower_bound(start);
+        if (next != free_extents.end() && start + n == next->first) {
+            n += next->second;
+            next = free_extents.erase(next);
+        }
+        if (next != free_extents.begin()) {
+            auto prev = std::prev(next);
+            if (prev->first + prev->second == start) {
+                prev->second += n;
+                return;
+            }
+        }
+        free_extents[start] = n;
+    }
+
+    // grows the extent of victim into a run of at least n pages with the neighbouring free
+    // extents and the unpinned clusters used after next, collected in run; the page x time
+    // the run holds per page, scaled to n pages, or -1 if the run cannot grow that far
+    double grow(size_t victim, size_t next, size_t n) {
+        run.assign(1, victim);
+        size_t lo = address_table[victim], hi = lo + pages[victim];
+        double w = weight(iters[victim][ptr[victim]], pages[victim]);
+        auto evictable = [&](size_t id) {
+            return !pins[id] && iters[id][ptr[id]] > next;
+        };
+        while (hi - lo < n) {
+            if (hi < size) {
+                auto f = free_extents.find(hi);
+                if (f != free_extents.end()) {
+                    hi += f->second;
+                    continue;
+                }
+                size_t id = used_extents.find(hi)->second;
+                if (evictable(id)) {
+                    run.push_back(id);
+                    w += weight(iters[id][ptr[id]], pages[id]);
+                    hi += pages[id];
+                    continue;
+                }
+            }
+            if (lo > 0) {
+                auto f = free_extents.lower_bound(lo);
+                if (f != free_extents.begin() && std::prev(f)->first + std::prev(f)->second == lo) {
+                    lo = std::prev(f)->first;
+                    continue;
+                }
+                size_t id = std::prev(used_extents.lower_bound(lo))->second;
+                if (evictable(id)) {
+                    run.push_back(id);
+                    w += weight(iters[id][ptr[id]], pages[id]);
+                    lo -= pages[id];
+                    continue;
+                }
+            }
+            return -1;
+        }
+        return w / (hi - lo) * n;
+    }
+
+    // frees a run of at least n pages for a cluster next used at next: the CANDIDATES unpinned
+    // clusters used furthest in the future (pinned ones are passed over without counting) are
+    // each grown into a run, and the heaviest run goes if it outweighs the newcomer; false if
+    // there is none
+    bool evict(size_t next, size_t n) {
+        held.clear();
+        best_run.clear();
+        double best_weight = weight(next, n);
+        size_t candidates = 0;
+        while (!priority.empty() && candidates < CANDIDATES) {
+            auto e = priority.pop();
+            held.push_back(e);
+            if (pins[e.first]) continue;
+            // the rest is used before the newcomer
+            if (e.second <= next) break;
+            candidates++;
+            double w = grow(e.first, next, n);
+            if (w > best_weight) {
+                best_weight = w;
+                best_run.swap(run);
+            }
+        }
+        auto victim = [&](size_t id) {
+            return std::find(best_run.begin(), best_run.end(), id) != best_run.end();
+        };
+        for (auto& e : held) {
+            if (!victim(e.first)) priority.add(e);
+        }
+        if (best_run.empty()) return false;
+        for (auto id : best_run) {
+            priority.remove(id);
+            used_extents.erase(address_table[id]);
+            deallocate(address_table[id], pages[id]);
+            address_table[id] = -1;
+        }
         return true;
     }
 
-    inline void push(size_t id, float* buffer, unsigned bucket_length) {
-        if (filled < size) {
-            address_table[id] = filled;
-            memcpy(data + address_table[id] * length, buffer, bucket_length * sizeof(float));
-            priority.add(std::make_pair(id, iters[id][ptr[id]]));
-            filled++;
-        } else if (priority.top().second > iters[id][ptr[id]]) {
-            memcpy(data + address_table[priority.top().first] * length, buffer, bucket_length * sizeof(float));
-            address_table[id] = address_table[priority.top().first];
-            address_table[priority.top().first] = -1;
-            priority.pop();
-            priority.add(std::make_pair(id, iters[id][ptr[id]]));
+    // places a missing cluster in an extent of bytes, -1 if it is not worth caching
+    int place(size_t id, size_t bytes) {
+        size_t n = div_round_up(bytes, PAGE_SIZE);
+        if (n > size) return -1;
+        auto next = iters[id][ptr[id]];
+        if (next == std::numeric_limits<size_t>::max()) return -1;
+        int start = allocate(n);
+        while (start == -1) {
+            if (!evict(next, n)) return -1;
+            start = allocate(n);
         }
+        address_table[id] = start;
+        used_extents[start] = id;
+        pages[id] = n;
+        priority.add(std::make_pair(id, next));
+        return start;
+    }
+
+    // an extent of bytes for a missing cluster that the caller fills, or nullptr if the
+    // cluster is not worth caching
+    inline char* push(size_t id, size_t bytes) {
+        if (place(id, bytes) == -1) return nullptr;
+        return pin(id);
+    }
+
+    // an extent for a cluster that is filled ahead of its next use, which must not come
+    // before task number from; it stays pinned across release until unreserve
+    inline char* reserve(size_t id, size_t bytes, size_t from) {
+        if (iters[id][ptr[id]] < from || place(id, bytes) == -1) return nullptr;
+        pins[id]++;
+        return data + address_table[id] * PAGE_SIZE;
+    }
+
+    inline void unreserve(size_t id) {
+        pins[id]--;
+    }
+
+    // unpins every cluster handed out since the last release
+    void release() {
+        for (auto id : pinned) pins[id]--;
+        pinned.clear();
     }
 
     ~Cache() {
-        delete[] data;
+        free(data);
     }
 };
 
@@ -75,7 +265,7 @@ struct LRUCache {
     size_t budget;
     size_t size;
     size_t length;
-    float* data;
+    char* data;
 
     size_t filled;
     size_t hit;
@@ -85,8 +275,8 @@ struct LRUCache {
     std::vector<int> address_table;
 
     LRUCache(size_t budget, size_t length): budget(budget), length(length) {
-        size = budget / 4 / length;
-        data = new float[length * size];
+        size = budget / length;
+        data = new char[length * size];
         priority = updateable_heap<size_t, size_t, std::greater<size_t>>(size + 1);
         filled = 0;
         hit = 0;
@@ -100,23 +290,23 @@ struct LRUCache {
         for (size_t i = 0; i < n; i++) total += tasks[i].size();
     }
 
-    inline bool find(size_t id, float* buffer, unsigned bucket_length) {
+    inline bool find(size_t id, char* buffer, size_t bucket_length) {
         cnt++;
         if (address_table[id] == -1) return false;
         hit++;
         priority.update(std::make_pair(id, total - cnt));
-        memcpy(buffer, data + address_table[id] * length, bucket_length * sizeof(float));
+        memcpy(buffer, data + address_table[id] * length, bucket_length);
         return true;
     }
 
-    inline void push(size_t id, float* buffer, unsigned bucket_length) {
+    inline void push(size_t id, char* buffer, size_t bucket_length) {
         if (filled < size) {
             address_table[id] = filled;
-            memcpy(data + address_table[id] * length, buffer, bucket_length * sizeof(float));
+            memcpy(data + address_table[id] * length, buffer, bucket_length);
             priority.add(std::make_pair(id, total - cnt));
             filled++;
         } else {
-            memcpy(data + address_table[priority.top().first] * length, buffer, bucket_length * sizeof(float));
+            memcpy(data + address_table[priority.top().first] * length, buffer, bucket_length);
             address_table[id] = address_table[priority.top().first];
             address_table[priority.top().first] = -1;
             priority.pop();
@@ -3,19 +3,33 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <limits>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <omp.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
 
 #include "DataReader.h"
+#include "Quantizer.h"
+#include "IoUring.h"
 #include "../utils/utils.h"
 #include "../utils/dist_func.h"
 
 auto dist_l2 = utils::L2Sqr;
 
 #define MAX_IO_SIZE 2147479552
-#define PAGE_SIZE 4096
+#define INTERLEAVE_WIDTH 16
+// the metadata starts with these two words; bump the version whenever its fields change
+#define METADATA_MAGIC 0x4154454d4e494f4aULL
+#define METADATA_VERSION 2
 
 struct ClusterWriter {
     DataReader data_reader;
@@ -30,18 +44,77 @@ struct ClusterWriter {
     std::vector<size_t> bucket_sizes;
     float* centroids_;
     std::vector<float> radii;
+    utils::Storage storage;
+    size_t vec_size;
+    std::vector<float> dim_min;
+    std::vector<float> dim_max;
+    std::vector<float> centroid_dists;
+    std::vector<size_t> block_offset;
+    std::vector<size_t> block_starts;
+    std::vector<float> block_centroids;
+    std::vector<float> block_radii;
+    std::vector<float> box_min;
+    std::vector<float> box_max;
+    std::vector<size_t> dim_perm;
+    size_t point_num;
+    std::vector<size_t> group_offset;
+    std::vector<size_t> group_ids;
+    bool aligned;
+    size_t head_dims;
 
-    ClusterWriter(std::string datafile, std::string clusterfile, std::string metafile): 
+    ClusterWriter(std::string datafile, std::string clusterfile, std::string metafile, utils::Storage storage = utils::STORAGE_FP32): 
         clusterfile(clusterfile), 
         data_reader(datafile),
         fcluster(clusterfile, std::ios::binary | std::ios::out),
-        fmeta(metafile, std::ios::binary | std::ios::out) {
+        fmeta(metafile, std::ios::binary | std::ios::out),
+        storage(storage) {
         n = data_reader.n;
         d = data_reader.d;
+        point_num = n;
+        aligned = false;
+        head_dims = 0;
+        vec_size = d * utils::storage_elem_size(storage);
+        dim_perm.resize(d);
+        for (size_t k = 0; k < d; k++) dim_perm[k] = k;
+        // a layout or stripes planned for the previous cluster file do not apply to the new one
+        remove((clusterfile + ".layout").c_str());
+        remove((clusterfile + ".stripes").c_str());
+    }
+
+    // stores the dimensions in decreasing order of their variance, so a partial distance
+    // over the first dimensions grows as fast as possible
+    void orderDimensions() {
+        std::vector<double> sum(d, 0), sum2(d, 0);
+        size_t batch_size = n / 1000;
+        std::vector<float> data_buf(batch_size * d);
+        data_reader.reset();
+        for (size_t i = 0; i < div_round_up(n, batch_size); i++) {
+            size_t num = batch_size * (i + 1) < n ? batch_size : n - batch_size * i;
+            data_reader.get_batch((char*)data_buf.data(), num);
+            for (size_t j = 0; j < num; j++) {
+                for (size_t k = 0; k < d; k++) {
+                    sum[k] += data_buf[j * d + k];
+                    sum2[k] += (double)data_buf[j * d + k] * data_buf[j * d + k];
+                }
+            }
+        }
+        data_reader.reset();
+        std::vector<double> var(d);
+        for (size_t k = 0; k < d; k++) var[k] = sum2[k] / n - (sum[k] / n) * (sum[k] / n);
+        std::stable_sort(dim_perm.begin(), dim_perm.end(), [&](size_t a, size_t b) {
+            return var[a] > var[b];
+        });
+    }
+
+    void permute(float* vec, float* tmp) {
+        for (size_t k = 0; k < d; k++) tmp[k] = vec[dim_perm[k]];
+        memcpy(vec, tmp, d * sizeof(float));
     }
 
     void writeClusters(std::vector<std::vector<size_t>>& assignment, float* centroids, float budget) {
         centroids_ = centroids;
+        std::vector<float> tmp(d);
+        for (size_t i = 0; i < assignment.size(); i++) permute(centroids + i * d, tmp.data());
         std::vector<unsigned> id_cluster_map(n);
         max_points = 0;
         for (size_t i = 0; i < assignment.size(); i++) {
@@ -55,14 +128,14 @@ struct ClusterWriter {
         }
         cluster_num = assignment.size();
         radii.resize(cluster_num);
-        size_t buffer_size = div_round_up(budget * (size_t)1024 * 1024 * 1024 / cluster_num, d * 4) * d * 4;
+        size_t buffer_size = div_round_up(budget * (size_t)1024 * 1024 * 1024 / cluster_num, vec_size) * vec_size;
         char* buffer = new char[cluster_num * buffer_size];
         std::vector<size_t> buffer_pos(cluster_num);
         std::vector<size_t> file_pos(cluster_num);
         size_t cumu_size = 0;
         for (size_t i = 0; i < cluster_num; i++) {
             buffer_pos[i] = buffer_size * i;
-            file_pos[i] = cumu_size * sizeof(float) * d;
+            file_pos[i] = cumu_size * vec_size;
             cumu_size += bucket_sizes[i];
         }
         size_t batch_size = n / 1000;
@@ -73,10 +146,11 @@ struct ClusterWriter {
             for (size_t j = 0; j < num; j++) {
                 auto id = j + batch_size * i;
                 auto cluster = id_cluster_map[id];
+                permute(data_buf + j * d, tmp.data());
                 float dist = dist_l2(data_buf + j * d, centroids + cluster * d, &d);
                 if (dist > radii[cluster]) radii[cluster] = dist;
-                memcpy(buffer + buffer_pos[cluster], data_buf + j * d, d * 4);
-                buffer_pos[cluster] += d * 4;
+                utils::encode_vector(data_buf + j * d, buffer + buffer_pos[cluster], d, storage);
+                buffer_pos[cluster] += vec_size;
                 if (buffer_pos[cluster] == buffer_size * (cluster + 1)) {
                     buffer_pos[cluster] -= buffer_size;
                     fcluster.seekp(file_pos[cluster], std::ios::beg);
@@ -91,14 +165,324 @@ struct ClusterWriter {
                 fcluster.write(buffer + buffer_size * i, buffer_pos[i] % buffer_size);
             }
         }
-        auto file_size = div_round_up(n * d * sizeof(float), 4096);
+        auto file_size = div_round_up(n * vec_size, 4096);
         fcluster.seekp(file_size, std::ios::beg);
         for (size_t i = 0; i < cluster_num; i++) {
             radii[i] = sqrt(radii[i]);
         }
     }
 
+    // cuts points idx[begin, end) into blocks of at most block_size points by recursive
+    // median splits along the dimension of largest spread
+    void splitBlocks(const float* vecs, size_t* idx, size_t begin, size_t end, size_t block_size, std::vector<size_t>& starts) {
+        if (end - begin <= block_size) {
+            starts.push_back(begin);
+            return;
+        }
+        size_t split_dim = 0;
+        float max_spread = -1;
+        for (size_t k = 0; k < d; k++) {
+            float lo = std::numeric_limits<float>::max(), hi = std::numeric_limits<float>::lowest();
+            for (size_t j = begin; j < end; j++) {
+                lo = std::min(lo, vecs[idx[j] * d + k]);
+                hi = std::max(hi, vecs[idx[j] * d + k]);
+            }
+            if (hi - lo > max_spread) {
+                max_spread = hi - lo;
+                split_dim = k;
+            }
+        }
+        size_t mid = (begin + end) / 2;
+        std::nth_element(idx + begin, idx + mid, idx + end, [&](size_t a, size_t b) {
+            return vecs[a * d + split_dim] < vecs[b * d + split_dim];
+        });
+        splitBlocks(vecs, idx, begin, mid, block_size, starts);
+        splitBlocks(vecs, idx, mid, end, block_size, starts);
+    }
+
+    // collapses vectors whose fp32 input is bit-identical within each cluster: only the one
+    // with the smallest id stays in the cluster file, and group_ids[group_offset[id],
+    // group_offset[id + 1]) lists the members of the group it represents (empty for the
+    // collapsed ones). Equal input means equal stored bytes, so candidates are found on the
+    // stored form and only for fp16/bf16 the input of the candidates is read back to keep
+    // vectors that only became equal in the stored form apart
+    void dedupClusters(std::vector<std::vector<size_t>>& assignment) {
+        fcluster.flush();
+        std::fstream io(clusterfile, std::ios::binary | std::ios::in | std::ios::out);
+        std::vector<char> raw(max_points * vec_size);
+        std::vector<float> input(max_points * d);
+        std::vector<char> loaded(max_points);
+        size_t input_size = d * sizeof(float);
+        std::vector<std::pair<uint64_t, size_t>> hashes(max_points);
+        std::vector<size_t> rep(max_points);
+        std::vector<size_t> rep_of(n);
+        size_t read_pos = 0, write_pos = 0;
+        max_points = 0;
+        for (size_t i = 0; i < cluster_num; i++) {
+            auto size = bucket_sizes[i];
+            io.seekg(read_pos * vec_size, std::ios::beg);
+            io.read(raw.data(), size * vec_size);
+            read_pos += size;
+            auto& ids = assignment[i];
+            for (size_t j = 0; j < size; j++) {
+                hashes[j] = std::make_pair(hash_bytes(raw.data() + j * vec_size, vec_size), j);
+                rep[j] = j;
+                loaded[j] = 0;
+            }
+            auto same_input = [&](size_t a, size_t b) -> bool {
+                if (storage == utils::STORAGE_FP32) return true;
+                for (auto j : {a, b}) {
+                    if (!loaded[j]) data_reader.read_vector(ids[j], input.data() + j * d);
+                    loaded[j] = 1;
+                }
+                return memcmp(input.data() + a * d, input.data() + b * d, input_size) == 0;
+            };
+            std::sort(hashes.begin(), hashes.begin() + size);
+            for (size_t a = 0; a < size; a++) {
+                auto ja = hashes[a].second;
+                if (rep[ja] != ja) continue;
+                for (size_t b = a + 1; b < size && hashes[b].first == hashes[a].first; b++) {
+                    auto jb = hashes[b].second;
+                    if (rep[jb] == jb && memcmp(raw.data() + ja * vec_size, raw.data() + jb * vec_size, vec_size) == 0 && same_input(ja, jb)) rep[jb] = ja;
+                }
+            }
+            size_t kept = 0;
+            for (size_t j = 0; j < size; j++) rep_of[ids[j]] = ids[rep[j]];
+            for (size_t j = 0; j < size; j++) {
+                if (rep[j] != j) continue;
+                memmove(raw.data() + kept * vec_size, raw.data() + j * vec_size, vec_size);
+                ids[kept++] = ids[j];
+            }
+            ids.resize(kept);
+            io.seekp(write_pos * vec_size, std::ios::beg);
+            io.write(raw.data(), kept * vec_size);
+            write_pos += kept;
+            bucket_sizes[i] = kept;
+            max_points = std::max(max_points, kept);
+        }
+        point_num = write_pos;
+        group_offset.assign(n + 1, 0);
+        for (size_t id = 0; id < n; id++) group_offset[rep_of[id] + 1]++;
+        for (size_t id = 0; id < n; id++) group_offset[id + 1] += group_offset[id];
+        group_ids.resize(n);
+        std::vector<size_t> fill(group_offset.begin(), group_offset.end() - 1);
+        for (size_t id = 0; id < n; id++) group_ids[fill[rep_of[id]]++] = id;
+    }
+
+    // orders the points of every cluster by their distance to its centroid, so the join can
+    // restrict the candidates of a point to a window of that distance (triangle inequality).
+    // With block_size > 0 the cluster is first cut into micro-blocks and the order applies
+    // within each block; every block keeps its own centroid and radius.
+    // radii, the per-dimension bounding boxes and the per-dimension ranges of the codes are
+    // taken from the stored vectors, which differ from the input for fp16/bf16
+    void sortClusters(std::vector<std::vector<size_t>>& assignment, size_t block_size = 0) {
+        fcluster.flush();
+        std::fstream io(clusterfile, std::ios::binary | std::ios::in | std::ios::out);
+        std::vector<char> raw(max_points * vec_size);
+        std::vector<char> sorted(max_points * vec_size);
+        std::vector<float> vecs(max_points * d);
+        std::vector<float> dists(max_points);
+        std::vector<size_t> idx(max_points);
+        std::vector<size_t> ids(max_points);
+        std::vector<size_t> starts;
+        std::vector<float> block_centroid(d);
+        centroid_dists.resize(point_num);
+        block_offset.assign(1, 0);
+        block_starts.clear();
+        block_centroids.clear();
+        block_radii.clear();
+        box_min.assign(cluster_num * d, 0);
+        box_max.assign(cluster_num * d, 0);
+        dim_min.assign(d, std::numeric_limits<float>::max());
+        dim_max.assign(d, std::numeric_limits<float>::lowest());
+        size_t cumu_size = 0;
+        for (size_t i = 0; i < cluster_num; i++) {
+            auto size = bucket_sizes[i];
+            io.seekg(cumu_size * vec_size, std::ios::beg);
+            io.read(raw.data(), size * vec_size);
+            for (size_t j = 0; j < size; j++) {
+                utils::decode_vector(raw.data() + j * vec_size, vecs.data() + j * d, d, storage);
+                dists[j] = sqrt(dist_l2(vecs.data() + j * d, centroids_ + i * d, &d));
+                idx[j] = j;
+                for (size_t k = 0; k < d; k++) {
+                    float v = vecs[j * d + k];
+                    if (j == 0 || v < box_min[i * d + k]) box_min[i * d + k] = v;
+                    if (j == 0 || v > box_max[i * d + k]) box_max[i * d + k] = v;
+                    dim_min[k] = std::min(dim_min[k], v);
+                    dim_max[k] = std::max(dim_max[k], v);
+                }
+            }
+            starts.clear();
+            if (size > 0) {
+                if (block_size == 0) starts.push_back(0);
+                else splitBlocks(vecs.data(), idx.data(), 0, size, block_size, starts);
+            }
+            radii[i] = 0;
+            for (size_t b = 0; b < starts.size(); b++) {
+                size_t begin = starts[b], end = b + 1 < starts.size() ? starts[b + 1] : size;
+                std::sort(idx.begin() + begin, idx.begin() + end, [&](size_t a, size_t c) {
+                    return dists[a] < dists[c];
+                });
+                std::fill(block_centroid.begin(), block_centroid.end(), 0);
+                for (size_t j = begin; j < end; j++) {
+                    for (size_t k = 0; k < d; k++) block_centroid[k] += vecs[idx[j] * d + k];
+                }
+                for (size_t k = 0; k < d; k++) block_centroid[k] /= end - begin;
+                float block_radius = 0;
+                for (size_t j = begin; j < end; j++) {
+                    block_radius = std::max(block_radius, (float)sqrt(dist_l2(vecs.data() + idx[j] * d, block_centroid.data(), &d)));
+                    radii[i] = std::max(radii[i], dists[idx[j]]);
+                }
+                block_starts.push_back(begin);
+                block_centroids.insert(block_centroids.end(), block_centroid.begin(), block_centroid.end());
+                block_radii.push_back(block_radius);
+            }
+            block_offset.push_back(block_starts.size());
+            std::copy(assignment[i].begin(), assignment[i].end(), ids.begin());
+            for (size_t j = 0; j < size; j++) {
+                memcpy(sorted.data() + j * vec_size, raw.data() + idx[j] * vec_size, vec_size);
+                assignment[i][j] = ids[idx[j]];
+                centroid_dists[cumu_size + j] = dists[idx[j]];
+            }
+            io.seekp(cumu_size * vec_size, std::ios::beg);
+            io.write(sorted.data(), size * vec_size);
+            cumu_size += size;
+        }
+    }
+
+    // code file layout: per-dimension min and step (d floats each), then one byte per
+    // dimension for every point, in the same cluster order as the cluster file
+    void writeCodes(std::string codefile) {
+        fcluster.flush();
+        std::ifstream in(clusterfile, std::ios::binary);
+        std::ofstream out(codefile, std::ios::binary);
+        ScalarQuantizer sq(d, dim_min.data(), dim_max.data());
+        out.write((char*)sq.vmin.data(), sizeof(float) * d);
+        out.write((char*)sq.step.data(), sizeof(float) * d);
+        std::vector<char> raw(max_points * vec_size);
+        std::vector<float> vec(d);
+        std::vector<uint8_t> codes(max_points * d);
+        for (size_t i = 0; i < cluster_num; i++) {
+            in.read(raw.data(), bucket_sizes[i] * vec_size);
+            for (size_t j = 0; j < bucket_sizes[i]; j++) {
+                utils::decode_vector(raw.data() + j * vec_size, vec.data(), d, storage);
+                sq.encode(vec.data(), codes.data() + j * d);
+            }
+            out.write((char*)codes.data(), bucket_sizes[i] * d);
+        }
+    }
+
+    // sketch file layout: rotation signs (3 * D floats), then the codes of all points and
+    // then their residual norms, both in the same cluster order as the cluster file
+    void writeSketches(std::string sketchfile) {
+        fcluster.flush();
+        std::ifstream in(clusterfile, std::ios::binary);
+        std::ofstream out(sketchfile, std::ios::binary);
+        SignSketch sketch(d);
+        out.write((char*)sketch.signs.data(), sizeof(float) * sketch.signs.size());
+        std::vector<char> raw(max_points * vec_size);
+        std::vector<float> vec(d);
+        std::vector<float> rotated(sketch.D);
+        std::vector<uint64_t> codes(max_points * sketch.words);
+        std::vector<float> norms(point_num);
+        size_t cumu_size = 0;
+        for (size_t i = 0; i < cluster_num; i++) {
+            in.read(raw.data(), bucket_sizes[i] * vec_size);
+            for (size_t j = 0; j < bucket_sizes[i]; j++) {
+                utils::decode_vector(raw.data() + j * vec_size, vec.data(), d, storage);
+                norms[cumu_size + j] = sketch.encode(vec.data(), centroids_ + i * d, rotated.data(), codes.data() + j * sketch.words);
+            }
+            out.write((char*)codes.data(), bucket_sizes[i] * sketch.words * sizeof(uint64_t));
+            cumu_size += bucket_sizes[i];
+        }
+        out.write((char*)norms.data(), sizeof(float) * point_num);
+    }
+
+    // head file layout: the number of head dimensions m, then for every point its first m
+    // dimensions followed by the norm of the remaining ones, in the same cluster order as
+    // the cluster file. The cluster file is split accordingly: it keeps only the remaining
+    // d - m dimensions of every point, so a fetch reads just the tails. At least one
+    // dimension stays in the cluster file
+    void writeHeads(std::string headfile, size_t m) {
+        fcluster.close();
+        std::ifstream in(clusterfile, std::ios::binary);
+        std::ofstream out(headfile, std::ios::binary);
+        std::string tmpfile = clusterfile + ".tmp";
+        std::ofstream tails(tmpfile, std::ios::binary | std::ios::out);
+        if (!out.is_open() || !tails.is_open()) {
+            std::cout << "open head file error" << std::endl;
+            exit(-1);
+        }
+        m = std::min(m, d - 1);
+        out.write((char*)&m, sizeof(size_t));
+        size_t elem_size = utils::storage_elem_size(storage);
+        size_t tail_size = (d - m) * elem_size;
+        std::vector<char> raw(max_points * vec_size);
+        std::vector<char> tail_raw(max_points * tail_size);
+        std::vector<float> vec(d);
+        std::vector<float> heads(max_points * (m + 1));
+        for (size_t i = 0; i < cluster_num; i++) {
+            in.read(raw.data(), bucket_sizes[i] * vec_size);
+            for (size_t j = 0; j < bucket_sizes[i]; j++) {
+                utils::decode_vector(raw.data() + j * vec_size, vec.data(), d, storage);
+                float* head = heads.data() + j * (m + 1);
+                memcpy(head, vec.data(), m * sizeof(float));
+                float tail = 0;
+                for (size_t k = m; k < d; k++) tail += vec[k] * vec[k];
+                head[m] = sqrt(tail);
+                memcpy(tail_raw.data() + j * tail_size, raw.data() + j * vec_size + m * elem_size, tail_size);
+            }
+            out.write((char*)heads.data(), bucket_sizes[i] * (m + 1) * sizeof(float));
+            tails.write(tail_raw.data(), bucket_sizes[i] * tail_size);
+        }
+        in.close();
+        tails.close();
+        if (!tails || rename(tmpfile.c_str(), clusterfile.c_str()) != 0) {
+            std::cout << "replace cluster file error" << std::endl;
+            exit(-1);
+        }
+        head_dims = m;
+        vec_size = tail_size;
+    }
+
+    // moves every cluster to the start of a page, so reading a cluster brings in none of the
+    // bytes of its neighbors; the offsets follow from the sizes and the aligned flag
+    void alignClusters() {
+        fcluster.close();
+        std::ifstream in(clusterfile, std::ios::binary);
+        std::string tmpfile = clusterfile + ".tmp";
+        std::ofstream out(tmpfile, std::ios::binary | std::ios::out);
+        if (!out.is_open()) {
+            std::cout << "open cluster file error" << std::endl;
+            exit(-1);
+        }
+        std::vector<char> vecs(max_points * vec_size);
+        std::vector<char> pad(PAGE_SIZE, 0);
+        for (size_t i = 0; i < cluster_num; i++) {
+            size_t bytes = bucket_sizes[i] * vec_size;
+            in.read(vecs.data(), bytes);
+            out.write(vecs.data(), bytes);
+            out.write(pad.data(), div_round_up(bytes, PAGE_SIZE) * PAGE_SIZE - bytes);
+        }
+        out.flush();
+        out.close();
+        // a failed read or write (e.g. a full disk) must not replace the cluster file
+        if (!in.good() || !out.good() || !sync_file(tmpfile)) {
+            std::cout << "write cluster file error" << std::endl;
+            exit(-1);
+        }
+        in.close();
+        if (rename(tmpfile.c_str(), clusterfile.c_str()) != 0) {
+            std::cout << "replace cluster file error" << std::endl;
+            exit(-1);
+        }
+        aligned = true;
+    }
+
     void writeMetadata(std::vector<std::vector<size_t>>& assignment) {
+        uint64_t magic = METADATA_MAGIC, version = METADATA_VERSION;
+        fmeta.write((char*)&magic, sizeof(uint64_t));
+        fmeta.write((char*)&version, sizeof(uint64_t));
         fmeta.write((char*)&n, sizeof(size_t));
         fmeta.write((char*)&d, sizeof(size_t));
         fmeta.write((char*)&cluster_num, sizeof(size_t));
@@ -109,6 +493,26 @@ struct ClusterWriter {
         for (size_t i = 0; i < cluster_num; i++) {
             fmeta.write((char*)assignment[i].data(), assignment[i].size() * sizeof(size_t));
         }
+        size_t storage_code = storage;
+        fmeta.write((char*)&storage_code, sizeof(size_t));
+        fmeta.write((char*)centroid_dists.data(), sizeof(float) * point_num);
+        size_t block_num = block_starts.size();
+        fmeta.write((char*)block_offset.data(), sizeof(size_t) * (cluster_num + 1));
+        fmeta.write((char*)block_starts.data(), sizeof(size_t) * block_num);
+        fmeta.write((char*)block_centroids.data(), sizeof(float) * block_num * d);
+        fmeta.write((char*)block_radii.data(), sizeof(float) * block_num);
+        fmeta.write((char*)box_min.data(), sizeof(float) * cluster_num * d);
+        fmeta.write((char*)box_max.data(), sizeof(float) * cluster_num * d);
+        fmeta.write((char*)dim_perm.data(), sizeof(size_t) * d);
+        size_t grouped = !group_offset.empty();
+        fmeta.write((char*)&grouped, sizeof(size_t));
+        if (grouped) {
+            fmeta.write((char*)group_offset.data(), sizeof(size_t) * (n + 1));
+            fmeta.write((char*)group_ids.data(), sizeof(size_t) * n);
+        }
+        size_t aligned_code = aligned;
+        fmeta.write((char*)&aligned_code, sizeof(size_t));
+        fmeta.write((char*)&head_dims, sizeof(size_t));
 
         fmeta.seekp(0, std::ios::end);
     }
@@ -120,12 +524,12 @@ struct ClusterWriter {
 };
 
 struct ClusterReader {
+    std::string clusterfile;
     std::ifstream fcluster;
     std::ifstream fmeta;
 
     int cluster_fd;
 
-    size_t max_task_size;
     size_t task_num;
 
     size_t n;
@@ -136,25 +540,93 @@ struct ClusterReader {
     std::vector<float> centroids;
     std::vector<float> radii;
     std::vector<size_t> file_pos;
+    std::vector<size_t> layout;
     std::vector<std::vector<size_t>> assignment;
+    utils::Storage storage;
+    size_t vec_size;
+    std::vector<float> centroid_dists;
+    std::vector<size_t> point_pos;
+    std::vector<size_t> block_offset;
+    std::vector<size_t> block_starts;
+    std::vector<float> block_centroids;
+    std::vector<float> block_radii;
+    std::vector<float> box_min;
+    std::vector<float> box_max;
+    std::vector<size_t> dim_perm;
+    size_t point_num;
+    std::vector<size_t> group_offset;
+    std::vector<size_t> group_ids;
 
     size_t buffer_size;
     char* buffer;
 
+    ScalarQuantizer sq;
+    uint8_t* codes;
+    size_t codes_size;
+    std::vector<size_t> code_pos;
+
+    size_t head_dims;
+    char* heads;
+    size_t heads_size;
+
+    SignSketch sketch;
+    std::vector<uint64_t> sketch_codes;
+    std::vector<float> sketch_norms;
+
+    // with stripes the clusters are spread over several files, one per device; cluster c is
+    // in stripe_of[c] at file_pos[c], and the unstriped cluster file is the only stripe 0
+    std::vector<std::string> stripe_files;
+    std::vector<int> stripe_fds;
+    std::vector<size_t> stripe_of;
+    bool aligned;
+    std::vector<std::thread> stripe_readers;
+    std::mutex io_mutex;
+    std::mutex read_mutex;
+    std::condition_variable read_cv;
+    std::condition_variable done_cv;
+    const std::function<void(size_t)>* read_job;
+    size_t read_round;
+    size_t read_pending;
+    bool read_stop;
+
+    IoUring ring;
+    bool use_uring;
+    std::vector<char*> maps;
+    std::vector<size_t> map_sizes;
+    size_t coalesce_gap;
+
     double total;
     double used;
+    size_t reads;
 
-    ClusterReader(std::string clusterfile, std::string metafile, size_t max_task_size = 1):
+    ClusterReader(std::string clusterfile, std::string metafile):
+        clusterfile(clusterfile),
         task_num(0),
-        max_task_size(max_task_size), 
         fcluster(clusterfile, std::ios::binary | std::ios::in), 
         fmeta(metafile, std::ios::binary | std::ios::in),
+        codes(nullptr),
+        heads(nullptr),
+        aligned(false),
+        read_job(nullptr),
+        read_round(0),
+        read_pending(0),
+        read_stop(false),
+        use_uring(false),
+        coalesce_gap(0),
         total(0),
-        used(0) {
+        used(0),
+        reads(0) {
         cluster_fd = open(clusterfile.c_str(), O_RDONLY | O_DIRECT);
     }
 
     void readMetaData() {
+        uint64_t magic = 0, version = 0;
+        fmeta.read((char*)&magic, sizeof(uint64_t));
+        fmeta.read((char*)&version, sizeof(uint64_t));
+        if (!fmeta || magic != METADATA_MAGIC || version != METADATA_VERSION) {
+            std::cout << "metadata file is missing or from another version, rebuild it" << std::endl;
+            exit(-1);
+        }
         fmeta.read((char*)&n, sizeof(size_t));
         fmeta.read((char*)&d, sizeof(size_t));
         fmeta.read((char*)&cluster_num, sizeof(size_t));
@@ -170,40 +642,580 @@ struct ClusterReader {
             assignment[i].resize(bucket_sizes[i]);
             fmeta.read((char*)assignment[i].data(), bucket_sizes[i] * sizeof(size_t));
         }
+        size_t storage_code = 0;
+        fmeta.read((char*)&storage_code, sizeof(size_t));
+        if (!fmeta) {
+            std::cout << "read metadata file error" << std::endl;
+            exit(-1);
+        }
+        storage = (utils::Storage)storage_code;
+        vec_size = d * utils::storage_elem_size(storage);
+        point_num = 0;
+        for (size_t i = 0; i < cluster_num; i++) point_num += bucket_sizes[i];
+        centroid_dists.resize(point_num);
+        fmeta.read((char*)centroid_dists.data(), sizeof(float) * point_num);
+        block_offset.resize(cluster_num + 1);
+        fmeta.read((char*)block_offset.data(), sizeof(size_t) * (cluster_num + 1));
+        size_t block_num = block_offset[cluster_num];
+        block_starts.resize(block_num);
+        fmeta.read((char*)block_starts.data(), sizeof(size_t) * block_num);
+        block_centroids.resize(block_num * d);
+        fmeta.read((char*)block_centroids.data(), sizeof(float) * block_num * d);
+        block_radii.resize(block_num);
+        fmeta.read((char*)block_radii.data(), sizeof(float) * block_num);
+        box_min.resize(cluster_num * d);
+        fmeta.read((char*)box_min.data(), sizeof(float) * cluster_num * d);
+        box_max.resize(cluster_num * d);
+        fmeta.read((char*)box_max.data(), sizeof(float) * cluster_num * d);
+        dim_perm.resize(d);
+        fmeta.read((char*)dim_perm.data(), sizeof(size_t) * d);
+        size_t grouped;
+        fmeta.read((char*)&grouped, sizeof(size_t));
+        if (grouped) {
+            group_offset.resize(n + 1);
+            fmeta.read((char*)group_offset.data(), sizeof(size_t) * (n + 1));
+            group_ids.resize(n);
+            fmeta.read((char*)group_ids.data(), sizeof(size_t) * n);
+        }
+        size_t aligned_code = 0;
+        fmeta.read((char*)&aligned_code, sizeof(size_t));
+        fmeta.read((char*)&head_dims, sizeof(size_t));
+        if (!fmeta) {
+            std::cout << "read metadata file error" << std::endl;
+            exit(-1);
+        }
+        aligned = aligned_code;
+        // with a head file the cluster file holds only the remaining dimensions
+        vec_size = (d - head_dims) * utils::storage_elem_size(storage);
+        point_pos.resize(cluster_num);
 
-        file_pos.resize(cluster_num);
         size_t cumu_size = 0;
         for (size_t i = 0; i < cluster_num; i++) {
-            file_pos[i] = cumu_size * sizeof(float) * d;
+            point_pos[i] = cumu_size;
             cumu_size += bucket_sizes[i];
         }
+        readLayout();
 
-        size_t page_num = div_round_up(max_points * d * 4, PAGE_SIZE);
+        size_t page_num = div_round_up(max_points * vec_size, PAGE_SIZE);
         buffer_size = PAGE_SIZE * (page_num + 1);
-        buffer = (char*)aligned_alloc(PAGE_SIZE, buffer_size * max_task_size);
+        buffer = nullptr;
+    }
+
+    // clusters at most gap bytes apart on disk are read together; the gaps are read into the
+    // scratch buffer, which is sized to hold one
+    void setCoalesceGap(size_t gap) {
+        coalesce_gap = gap;
+        free(buffer);
+        buffer = gap > 0 ? (char*)aligned_alloc(PAGE_SIZE, gap) : nullptr;
+    }
+
+    // the order of the clusters in the cluster file, the id order unless relayout() stored
+    // another one next to it. A layout file that is there must hold a permutation of the
+    // clusters and name the inode of the cluster file it was written with
+    void readLayout() {
+        layout.resize(cluster_num);
+        for (size_t i = 0; i < cluster_num; i++) layout[i] = i;
+        std::ifstream in(clusterfile + ".layout", std::ios::binary);
+        if (in.is_open()) {
+            size_t num = 0, inode = 0;
+            in.read((char*)&num, sizeof(size_t));
+            in.read((char*)&inode, sizeof(size_t));
+            if (in && num == cluster_num) in.read((char*)layout.data(), sizeof(size_t) * cluster_num);
+            std::vector<bool> seen(cluster_num, false);
+            bool valid = in && num == cluster_num && in.peek() == EOF;
+            for (size_t i = 0; i < cluster_num && valid; i++) {
+                valid = layout[i] < cluster_num && !seen[layout[i]];
+                if (valid) seen[layout[i]] = true;
+            }
+            struct stat st;
+            if (!valid || stat(clusterfile.c_str(), &st) != 0 || (size_t)st.st_ino != inode) {
+                std::cout << "layout file is malformed or does not match the cluster file, rebuild it" << std::endl;
+                exit(-1);
+            }
+        }
+        stripe_of.assign(cluster_num, 0);
+        placeClusters();
+    }
+
+    // bytes a cluster takes in the file, whole pages if the clusters are page aligned
+    inline size_t extentSize(size_t cluster_id) {
+        size_t bytes = bucket_sizes[cluster_id] * vec_size;
+        return aligned ? div_round_up(bytes, PAGE_SIZE) * PAGE_SIZE : bytes;
+    }
+
+    // every stripe holds its clusters back to back in layout order
+    void placeClusters() {
+        file_pos.resize(cluster_num);
+        std::vector<size_t> cumu_size(std::max(stripe_files.size(), (size_t)1), 0);
+        for (auto c : layout) {
+            file_pos[c] = cumu_size[stripe_of[c]];
+            cumu_size[stripe_of[c]] += extentSize(c);
+        }
+    }
+
+    inline size_t stripeNum() {
+        return std::max(stripe_files.size(), (size_t)1);
+    }
+
+    inline std::string stripeFile(size_t s) {
+        return stripe_files.empty() ? clusterfile : stripe_files[s];
+    }
+
+    inline int fdOf(size_t cluster_id) const {
+        return stripe_files.empty() ? cluster_fd : stripe_fds[stripe_of[cluster_id]];
+    }
+
+    // spreads the clusters over files, going through them in layout order and putting each
+    // on the stripe with the fewest bytes so far, so consecutive clusters of the schedule
+    // land on different devices. The assignment is kept next to the cluster file together
+    // with the layout, paths and file sizes it was made for; later runs reuse the stripes
+    // only if all of these still match
+    void stripe(const std::vector<std::string>& files) {
+        std::string stripefile = clusterfile + ".stripes";
+        std::vector<size_t> new_stripe_of(cluster_num);
+        std::vector<size_t> old_layout(cluster_num);
+        bool reuse = false;
+        std::ifstream in(stripefile, std::ios::binary);
+        if (in.is_open()) {
+            size_t num, stripe_num;
+            in.read((char*)&num, sizeof(size_t));
+            in.read((char*)&stripe_num, sizeof(size_t));
+            if (in && num == cluster_num && stripe_num == files.size()) {
+                reuse = true;
+                for (size_t s = 0; s < stripe_num && reuse; s++) {
+                    size_t len = 0, size = 0;
+                    in.read((char*)&len, sizeof(size_t));
+                    std::string path(in && len <= PATH_MAX ? len : 0, '\0');
+                    in.read(&path[0], path.size());
+                    in.read((char*)&size, sizeof(size_t));
+                    struct stat st;
+                    reuse = in && path == files[s] && stat(path.c_str(), &st) == 0 && (size_t)st.st_size == size;
+                }
+                if (reuse) {
+                    in.read((char*)new_stripe_of.data(), sizeof(size_t) * cluster_num);
+                    in.read((char*)old_layout.data(), sizeof(size_t) * cluster_num);
+                    reuse = in && old_layout == layout;
+                }
+            }
+            in.close();
+        }
+        if (!reuse) {
+            std::vector<size_t> load(files.size(), 0);
+            for (auto c : layout) {
+                new_stripe_of[c] = std::min_element(load.begin(), load.end()) - load.begin();
+                load[new_stripe_of[c]] += bucket_sizes[c];
+            }
+            std::vector<std::ofstream> outs(files.size());
+            std::vector<size_t> written(files.size(), 0);
+            for (size_t s = 0; s < files.size(); s++) {
+                outs[s].open(files[s], std::ios::binary | std::ios::out);
+                if (!outs[s].is_open()) {
+                    std::cout << "open stripe file error: " << files[s] << std::endl;
+                    exit(-1);
+                }
+            }
+            std::vector<char> vecs(max_points * vec_size + PAGE_SIZE, 0);
+            for (auto c : layout) {
+                readCluster(c, vecs.data());
+                outs[new_stripe_of[c]].write(vecs.data(), extentSize(c));
+                written[new_stripe_of[c]] += extentSize(c);
+            }
+            for (size_t s = 0; s < files.size(); s++) {
+                std::vector<char> pad(div_round_up(written[s], PAGE_SIZE) * PAGE_SIZE - written[s]);
+                outs[s].write(pad.data(), pad.size());
+                outs[s].close();
+                written[s] += pad.size();
+            }
+            std::ofstream out(stripefile, std::ios::binary | std::ios::out);
+            size_t num = cluster_num, stripe_num = files.size();
+            out.write((char*)&num, sizeof(size_t));
+            out.write((char*)&stripe_num, sizeof(size_t));
+            for (size_t s = 0; s < files.size(); s++) {
+                size_t len = files[s].size();
+                out.write((char*)&len, sizeof(size_t));
+                out.write(files[s].data(), len);
+                out.write((char*)&written[s], sizeof(size_t));
+            }
+            out.write((char*)new_stripe_of.data(), sizeof(size_t) * cluster_num);
+            out.write((char*)layout.data(), sizeof(size_t) * cluster_num);
+            out.close();
+        }
+        stripe_files = files;
+        stripe_of = new_stripe_of;
+        for (auto& f : files) {
+            int fd = open(f.c_str(), O_RDONLY | O_DIRECT);
+            if (fd == -1) {
+                std::cout << "open stripe file error: " << f << std::endl;
+                exit(-1);
+            }
+            stripe_fds.push_back(fd);
+        }
+        placeClusters();
+        if (files.size() > 1) {
+            for (size_t s = 0; s < files.size(); s++) stripe_readers.emplace_back(&ClusterReader::readStripe, this, s);
+        }
     }
 
-    void readCluster(size_t cluster_id, float* buffer) {
+    // long-lived reader of stripe s for blocking reads: runs read_job(s) for every batch
+    // readClusters hands out
+    void readStripe(size_t s) {
+        size_t round = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(read_mutex);
+                read_cv.wait(lock, [&] { return read_stop || read_round != round; });
+                if (read_stop) return;
+                round = read_round;
+            }
+            (*read_job)(s);
+            std::lock_guard<std::mutex> lock(read_mutex);
+            if (--read_pending == 0) done_cv.notify_one();
+        }
+    }
+
+    // rewrites the cluster file with the clusters in the order of new_layout and keeps that
+    // order next to it, so later runs on the same file read it from there. Both files are
+    // written aside and synced first; the layout records the inode of the new cluster file,
+    // so a crash between the two renames leaves a pair that readLayout refuses
+    void relayout(const std::vector<size_t>& new_layout) {
+        std::string tmpfile = clusterfile + ".tmp";
+        std::ofstream out(tmpfile, std::ios::binary | std::ios::out);
+        if (!out.is_open()) {
+            std::cout << "open cluster file error" << std::endl;
+            exit(-1);
+        }
+        std::vector<char> vecs(max_points * vec_size + PAGE_SIZE, 0);
+        size_t written = 0;
+        for (auto c : new_layout) {
+            readCluster(c, vecs.data());
+            out.write(vecs.data(), extentSize(c));
+            written += extentSize(c);
+        }
+        // keep the file a whole number of pages for the O_DIRECT reads of the last cluster
+        std::vector<char> pad(div_round_up(written, PAGE_SIZE) * PAGE_SIZE - written);
+        out.write(pad.data(), pad.size());
+        out.flush();
+        out.close();
+        struct stat st;
+        if (!fcluster.good() || !out.good() || !sync_file(tmpfile) || stat(tmpfile.c_str(), &st) != 0) {
+            std::cout << "write cluster file error" << std::endl;
+            exit(-1);
+        }
+        std::string layoutfile = clusterfile + ".layout";
+        std::ofstream flayout(layoutfile + ".tmp", std::ios::binary | std::ios::out);
+        size_t num = cluster_num, inode = st.st_ino;
+        flayout.write((char*)&num, sizeof(size_t));
+        flayout.write((char*)&inode, sizeof(size_t));
+        flayout.write((char*)new_layout.data(), sizeof(size_t) * cluster_num);
+        flayout.flush();
+        flayout.close();
+        if (!flayout.good() || !sync_file(layoutfile + ".tmp")) {
+            std::cout << "write layout file error" << std::endl;
+            exit(-1);
+        }
+        fcluster.close();
+        close(cluster_fd);
+        if (rename((layoutfile + ".tmp").c_str(), layoutfile.c_str()) != 0 || rename(tmpfile.c_str(), clusterfile.c_str()) != 0) {
+            std::cout << "replace cluster file error" << std::endl;
+            exit(-1);
+        }
+        size_t slash = clusterfile.rfind('/');
+        sync_file(slash == std::string::npos ? "." : clusterfile.substr(0, slash + 1));
+        fcluster.open(clusterfile, std::ios::binary | std::ios::in);
+        cluster_fd = open(clusterfile.c_str(), O_RDONLY | O_DIRECT);
+        readLayout();
+    }
+
+    // maps the whole cluster file (every stripe), so clusters are used in place from the
+    // page cache
+    void mapClusters() {
+        for (size_t s = 0; s < stripeNum(); s++) {
+            int fd = open(stripeFile(s).c_str(), O_RDONLY);
+            if (fd == -1) {
+                std::cout << "open cluster file error" << std::endl;
+                exit(-1);
+            }
+            struct stat st;
+            fstat(fd, &st);
+            char* base = (char*)mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (base == MAP_FAILED) {
+                std::cout << "map cluster file error" << std::endl;
+                exit(-1);
+            }
+            maps.push_back(base);
+            map_sizes.push_back(st.st_size);
+        }
+    }
+
+    inline char* mappedCluster(size_t cluster_id) {
+        return maps[stripe_of[cluster_id]] + file_pos[cluster_id];
+    }
+
+    // MADV_WILLNEED covers every page of the cluster, MADV_DONTNEED only the pages no
+    // other cluster shares
+    void adviseCluster(size_t cluster_id, int advice) {
+        size_t start = file_pos[cluster_id], end = start + bucket_sizes[cluster_id] * vec_size;
+        if (advice == MADV_DONTNEED) {
+            start = div_round_up(start, PAGE_SIZE) * PAGE_SIZE;
+            end = end / PAGE_SIZE * PAGE_SIZE;
+        } else {
+            start = start / PAGE_SIZE * PAGE_SIZE;
+            end = std::min(div_round_up(end, PAGE_SIZE) * PAGE_SIZE, map_sizes[stripe_of[cluster_id]]);
+        }
+        if (end > start) madvise(maps[stripe_of[cluster_id]] + start, end - start, advice);
+    }
+
+    // the code file is memory-mapped, the page cache keeps the hot part resident. Its size
+    // must match the points and dimensions of the cluster file
+    void mapCodes(std::string codefile) {
+        int fd = open(codefile.c_str(), O_RDONLY);
+        if (fd == -1) {
+            std::cout << "open code file error" << std::endl;
+            exit(-1);
+        }
+        struct stat st;
+        char* base = (char*)MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size == 2 * d * sizeof(float) + point_num * d) {
+            codes_size = st.st_size;
+            base = (char*)mmap(nullptr, codes_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (base == MAP_FAILED) {
+            std::cout << "code file is malformed or does not match the cluster file, rebuild it" << std::endl;
+            exit(-1);
+        }
+        sq.d = d;
+        sq.vmin.assign((float*)base, (float*)base + d);
+        sq.step.assign((float*)base + d, (float*)base + 2 * d);
+        sq.init();
+        codes = (uint8_t*)base;
+        code_pos.resize(cluster_num);
+        size_t cumu_size = 0;
+        for (size_t i = 0; i < cluster_num; i++) {
+            code_pos[i] = 2 * d * sizeof(float) + cumu_size * d;
+            cumu_size += bucket_sizes[i];
+        }
+    }
+
+    inline const uint8_t* getCodes(size_t cluster_id) {
+        return codes + code_pos[cluster_id];
+    }
+
+    // AoSoA copy of a loaded cluster for the interleaved kernel: groups of INTERLEAVE_WIDTH
+    // points, dimension k of point t of a group at k * INTERLEAVE_WIDTH + t; the last group
+    // is padded with zeros. vec is scratch room for d floats
+    void interleaveCluster(size_t cluster_id, const char* stored, float* out, float* vec) {
+        size_t size = bucket_sizes[cluster_id];
+        size_t groups = div_round_up(size, INTERLEAVE_WIDTH);
+        memset(out, 0, groups * INTERLEAVE_WIDTH * d * sizeof(float));
+        for (size_t l = 0; l < size; l++) {
+            decodePoint(cluster_id, l, stored, vec);
+            float* group = out + l / INTERLEAVE_WIDTH * INTERLEAVE_WIDTH * d + l % INTERLEAVE_WIDTH;
+            for (size_t k = 0; k < d; k++) group[k * INTERLEAVE_WIDTH] = vec[k];
+        }
+    }
+
+    // like the codes, the head file is memory-mapped and left to the page cache. Its head
+    // dimensions and size must match the cluster file
+    void mapHeads(std::string headfile) {
+        int fd = open(headfile.c_str(), O_RDONLY);
+        if (fd == -1) {
+            std::cout << "open head file error" << std::endl;
+            exit(-1);
+        }
+        struct stat st;
+        char* base = (char*)MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size == sizeof(size_t) + point_num * (head_dims + 1) * sizeof(float)) {
+            heads_size = st.st_size;
+            base = (char*)mmap(nullptr, heads_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (base == MAP_FAILED || *(size_t*)base != head_dims) {
+            std::cout << "head file is malformed or does not match the cluster file, rebuild it" << std::endl;
+            exit(-1);
+        }
+        heads = base;
+    }
+
+    // point l of a loaded cluster in fp32: with a head file the first head_dims dimensions
+    // come from there and only the rest from the cluster file
+    inline void decodePoint(size_t cluster_id, size_t l, const char* stored, float* out) {
+        if (head_dims > 0) memcpy(out, getHead(cluster_id, l), head_dims * sizeof(float));
+        utils::decode_vector(stored + l * vec_size, out + head_dims, d - head_dims, storage);
+    }
+
+    // the first head_dims dimensions of point l of the cluster, followed by the norm of the rest
+    inline const float* getHead(size_t cluster_id, size_t l) {
+        return (const float*)(heads + sizeof(size_t)) + (point_pos[cluster_id] + l) * (head_dims + 1);
+    }
+
+    // sketches are small enough to be kept in memory for the whole dataset
+    void readSketches(std::string sketchfile, float z) {
+        std::ifstream in(sketchfile, std::ios::binary);
+        if (!in.is_open()) {
+            std::cout << "open sketch file error" << std::endl;
+            exit(-1);
+        }
+        sketch.d = d;
+        sketch.init_dim();
+        sketch.signs.resize(3 * sketch.D);
+        in.read((char*)sketch.signs.data(), sizeof(float) * sketch.signs.size());
+        sketch.init_bounds(z);
+        sketch_codes.resize(point_num * sketch.words);
+        in.read((char*)sketch_codes.data(), sizeof(uint64_t) * sketch_codes.size());
+        sketch_norms.resize(point_num);
+        in.read((char*)sketch_norms.data(), sizeof(float) * point_num);
+        if (!in || in.peek() != EOF) {
+            std::cout << "sketch file is malformed or does not match the cluster file, rebuild it" << std::endl;
+            exit(-1);
+        }
+    }
+
+    // block b of cluster c holds points [block_starts[b], blockEnd(c, b)) of the cluster
+    inline size_t blockEnd(size_t c, size_t b) {
+        return b + 1 < block_offset[c + 1] ? block_starts[b + 1] : bucket_sizes[c];
+    }
+
+    // global index of the block holding point l of cluster c
+    inline size_t blockOf(size_t c, size_t l) {
+        return std::upper_bound(block_starts.begin() + block_offset[c], block_starts.begin() + block_offset[c + 1], l) - block_starts.begin() - 1;
+    }
+
+    void readCluster(size_t cluster_id, char* buffer) {
         fcluster.seekg(file_pos[cluster_id], std::ios::beg);
-        fcluster.read((char*)buffer, bucket_sizes[cluster_id] * d * 4);
+        fcluster.read(buffer, bucket_sizes[cluster_id] * vec_size);
+    }
+
+    // switches the cluster reads to io_uring with the cluster file (every stripe) registered;
+    // stays with blocking reads if the kernel does not allow it
+    void initUring(unsigned depth) {
+        std::vector<int> fds = stripe_files.empty() ? std::vector<int>(1, cluster_fd) : stripe_fds;
+        use_uring = ring.init(depth) && ring.register_files(fds.data(), fds.size());
+        if (!use_uring) std::cout << "io_uring unavailable, using blocking reads" << std::endl;
+    }
+
+    // bytes of the AoSoA copy of a cluster
+    inline size_t interleavedSize(size_t cluster_id) {
+        return div_round_up(bucket_sizes[cluster_id], INTERLEAVE_WIDTH) * INTERLEAVE_WIDTH * d * sizeof(float);
+    }
+
+    // the pages a cluster read to base takes, after which its AoSoA copy is kept
+    inline size_t readSize(size_t cluster_id) {
+        return div_round_up(pageOffset(cluster_id) + bucket_sizes[cluster_id] * vec_size, PAGE_SIZE) * PAGE_SIZE;
     }
 
-    void posixDirectReadCluster(size_t cluster_id, float* data_buffer) {
-        size_t buffer_offset = file_pos[cluster_id] % PAGE_SIZE;
-        size_t file_offset = file_pos[cluster_id] - buffer_offset;
-        size_t read_size = bucket_sizes[cluster_id] * d * 4;
-        size_t aligned_read_size = div_round_up(buffer_offset + read_size, PAGE_SIZE) * PAGE_SIZE;
-        total += aligned_read_size;
-        used += read_size;
-        lseek(cluster_fd, file_offset, SEEK_SET);
-        auto count = read(cluster_fd, buffer, aligned_read_size);
-        memcpy(data_buffer, buffer + buffer_offset, read_size);
+    // where the first vector of a cluster lies within its first page
+    inline size_t pageOffset(size_t cluster_id) {
+        return file_pos[cluster_id] % PAGE_SIZE;
+    }
+
+    // reads clusters ids[0..num) straight into their destinations: bases[j] is page aligned
+    // with room for buffer_size bytes and cluster ids[j] lands at bases[j] + pageOffset(ids[j]).
+    // With io_uring all of them are in flight together. Clusters whose pages are at most
+    // coalesce_gap bytes apart on disk are fetched with one vectored read of at most IOV_MAX
+    // buffers; the gaps go to the scratch buffer and a page shared by two clusters is read
+    // once and copied to the second. A read that fails or ends before the file does exits.
+    // Calls from the join and from the prefetcher take turns
+    void readClusters(const size_t* ids, char* const* bases, size_t num) {
+        std::lock_guard<std::mutex> io_lock(io_mutex);
+        std::vector<size_t> idx(num);
+        for (size_t j = 0; j < num; j++) idx[j] = j;
+        std::sort(idx.begin(), idx.end(), [&](size_t a, size_t b) {
+            return std::make_pair(stripe_of[ids[a]], file_pos[ids[a]]) < std::make_pair(stripe_of[ids[b]], file_pos[ids[b]]);
+        });
+        size_t max_gap = coalesce_gap;
+        // run r reads from run_start[r] into iovs[run_iov[r], run_iov[r + 1])
+        std::vector<iovec> iovs;
+        std::vector<size_t> run_iov, run_start, run_stripe;
+        std::vector<std::pair<char*, char*>> shared;
+        size_t end = 0;
+        char* last_page = nullptr;
+        for (size_t t = 0; t < num; t++) {
+            size_t c = ids[idx[t]];
+            char* base = bases[idx[t]];
+            size_t start = file_pos[c] / PAGE_SIZE * PAGE_SIZE;
+            size_t stop = div_round_up(file_pos[c] + bucket_sizes[c] * vec_size, PAGE_SIZE) * PAGE_SIZE;
+            used += bucket_sizes[c] * vec_size;
+            if (stop == start) continue;
+            size_t from = start;
+            // a cluster adds at most a gap and its own pages to the run
+            if (run_start.empty() || stripe_of[c] != run_stripe.back() || start > end + max_gap || iovs.size() - run_iov.back() + 2 > IOV_MAX) {
+                run_iov.push_back(iovs.size());
+                run_start.push_back(start);
+                run_stripe.push_back(stripe_of[c]);
+            } else if (start > end) {
+                iovs.push_back(iovec{buffer, start - end});
+            } else if (start < end) {
+                // clusters do not overlap, so only the last page read so far can be shared
+                shared.push_back(std::make_pair(base, last_page));
+                from = end;
+            }
+            if (stop > from) {
+                iovs.push_back(iovec{base + (from - start), stop - from});
+                end = stop;
+                last_page = base + (stop - start) - PAGE_SIZE;
+            }
+        }
+        run_iov.push_back(iovs.size());
+        // the last page of a file may be partial, so a run is expected to fill its buffers
+        // only up to the end of its file
+        std::vector<size_t> file_size(stripeNum());
+        for (size_t s = 0; s < stripeNum(); s++) {
+            struct stat st;
+            fstat(stripe_files.empty() ? cluster_fd : stripe_fds[s], &st);
+            file_size[s] = st.st_size;
+        }
+        std::vector<size_t> run_expect(run_start.size());
+        for (size_t r = 0; r + 1 < run_iov.size(); r++) {
+            size_t len = 0;
+            for (size_t v = run_iov[r]; v < run_iov[r + 1]; v++) len += iovs[v].iov_len;
+            run_expect[r] = std::min(len, file_size[run_stripe[r]] - std::min(run_start[r], file_size[run_stripe[r]]));
+            total += len;
+            reads++;
+            if (use_uring) ring.readv(iovs.data() + run_iov[r], run_iov[r + 1] - run_iov[r], run_start[r], run_stripe[r], run_expect[r]);
+        }
+        // blocking reads go to the stripes in parallel, each to the reader of its stripe
+        std::function<void(size_t)> read_stripe = [&](size_t s) {
+            for (size_t r = 0; r + 1 < run_iov.size(); r++) {
+                if (run_stripe[r] != s) continue;
+                int fd = stripe_files.empty() ? cluster_fd : stripe_fds[s];
+                auto count = preadv(fd, iovs.data() + run_iov[r], run_iov[r + 1] - run_iov[r], run_start[r]);
+                if (count < 0 || (size_t)count < run_expect[r]) {
+                    std::cout << "read cluster file error" << std::endl;
+                    exit(-1);
+                }
+            }
+        };
+        if (use_uring) {
+            ring.submit_and_wait();
+        } else if (stripeNum() == 1) {
+            read_stripe(0);
+        } else {
+            std::unique_lock<std::mutex> lock(read_mutex);
+            read_job = &read_stripe;
+            read_pending = stripe_readers.size();
+            read_round++;
+            read_cv.notify_all();
+            done_cv.wait(lock, [&] { return read_pending == 0; });
+        }
+        for (auto& p : shared) memcpy(p.first, p.second, PAGE_SIZE);
     }
 
     ~ClusterReader() {
+        {
+            std::lock_guard<std::mutex> lock(read_mutex);
+            read_stop = true;
+            read_cv.notify_all();
+        }
+        for (auto& t : stripe_readers) t.join();
         fcluster.close();
         fmeta.close();
         close(cluster_fd);
-        delete[] buffer;
+        free(buffer);
+        if (codes != nullptr) munmap(codes, codes_size);
+        if (heads != nullptr) munmap(heads, heads_size);
+        for (auto fd : stripe_fds) close(fd);
+        for (size_t s = 0; s < maps.size(); s++) munmap(maps[s], map_sizes[s]);
     }
 };
\ No newline at end of file
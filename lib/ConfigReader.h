@@ -17,6 +17,30 @@ struct ConfigReader{
     float error_bound;
     size_t gt;
 
+    // optional settings, given as "key value" lines after the fixed fields
+    string storage = "fp32";
+    float recheck_margin = 0;
+    string code_file = "";
+    string sketch_file = "";
+    float sketch_z = 3;
+    size_t block_size = 0;
+    float sweep_threshold = 0.25;
+    size_t early_abandon = 0;
+    string head_file = "";
+    size_t head_dims = 32;
+    bool interleave = false;
+    string output_file = "";
+    bool dedup = false;
+    string io_backend = "posix";
+    size_t io_depth = 64;
+    float seek_us = 0;
+    float read_mbps = 500;
+    size_t prefetch_depth = 0;
+    bool relayout = false;
+    size_t stream_slots = 0;
+    string stripe_files = "";
+    bool align_clusters = false;
+
     ConfigReader() = default;
 
     ConfigReader(string config) {
@@ -32,5 +56,34 @@ struct ConfigReader{
         in >> dummy_str >> mem_budget;
         in >> dummy_str >> error_bound;
         in >> dummy_str >> gt;
+        string key;
+        while (in >> key) {
+            if (key == "storage") in >> storage;
+            else if (key == "recheck_margin") in >> recheck_margin;
+            else if (key == "code_file") in >> code_file;
+            else if (key == "sketch_file") in >> sketch_file;
+            else if (key == "sketch_z") in >> sketch_z;
+            else if (key == "block_size") in >> block_size;
+            else if (key == "sweep_threshold") in >> sweep_threshold;
+            else if (key == "early_abandon") in >> early_abandon;
+            else if (key == "head_file") in >> head_file;
+            else if (key == "head_dims") in >> head_dims;
+            else if (key == "interleave") in >> interleave;
+            else if (key == "output_file") in >> output_file;
+            else if (key == "dedup") in >> dedup;
+            else if (key == "io_backend") in >> io_backend;
+            else if (key == "io_depth") in >> io_depth;
+            else if (key == "seek_us") in >> seek_us;
+            else if (key == "read_mbps") in >> read_mbps;
+            else if (key == "prefetch_depth") in >> prefetch_depth;
+            else if (key == "relayout") in >> relayout;
+            else if (key == "stream_slots") in >> stream_slots;
+            else if (key == "stripe_files") in >> stripe_files;
+            else if (key == "align_clusters") in >> align_clusters;
+            else {
+                std::cout << "unknown config key: " << key << std::endl;
+                exit(-1);
+            }
+        }
     }
-};
\ No newline at end of file
+};
@@ -11,10 +11,12 @@ struct DataReader {
     size_t n;
     size_t d;
     std::ifstream in;
+    int fd;
 
-    DataReader() {}
+    DataReader(): fd(-1) {}
 
     DataReader(std::string fn): in(fn, std::ios::binary) {
+        fd = open(fn.c_str(), O_RDONLY);
         unsigned n_, d_;
         in.read((char*)&n_, 4);
         in.read((char*)&d_, 4);
@@ -35,7 +37,17 @@ struct DataReader {
         in.read(buf, d * num * 4);
     }
 
+    // positional read of a single vector, safe to call from several threads
+    void read_vector(size_t id, float* buf) {
+        auto count = pread(fd, buf, d * 4, id * d * 4 + 8);
+        if (count != (ssize_t)(d * 4)) {
+            std::cout << "read data file error" << std::endl;
+            exit(-1);
+        }
+    }
+
     ~DataReader() {
         in.close();
+        if (fd != -1) close(fd);
     }
 };
\ No newline at end of file
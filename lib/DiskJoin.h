@@ -2,11 +2,20 @@
 
 #include <algorithm>
 #include <thread>
+#include <sstream>
 #include "Kmeans.h"
 #include "ClusterIO.h"
 #include "Gorder.h"
 #include "Cache.h"
 #include "ConfigReader.h"
+#include "ResultSink.h"
+#include "Prefetcher.h"
+
+enum BlockStatus : char {
+    BLOCK_COMPUTE = 0,
+    BLOCK_PRUNED = 1,
+    BLOCK_ACCEPTED = 2,
+};
 
 struct DiskJoin {
     void build(ConfigReader config) {
@@ -15,12 +24,15 @@ struct DiskJoin {
 
     void search(ConfigReader config) {
         float epsilon = sqrt(config.radius);
-        ClusterReader cluster_reader(config.cluster_file, config.metadata_file, config.K);
+        ClusterReader cluster_reader(config.cluster_file, config.metadata_file);
         cluster_reader.readMetaData();
         size_t max_comp = cluster_reader.n / cluster_reader.cluster_num * config.K;
         size_t cluster_num = cluster_reader.cluster_num;
         size_t empty_count = 0;
         size_t d = cluster_reader.d;
+        auto storage = cluster_reader.storage;
+        float eps2 = epsilon * epsilon;
+        float margin = storage == utils::STORAGE_FP32 ? 0 : config.recheck_margin * eps2;
         hnswlib::L2Space space(d);
         hnswlib::HierarchicalNSW<float>* graph = new hnswlib::HierarchicalNSW<float>(&space, config.hnsw_file);
         graph->radii = cluster_reader.radii;
@@ -28,6 +40,9 @@ struct DiskJoin {
         auto& assignment = cluster_reader.assignment;
         float* centroids = cluster_reader.centroids.data();
         std::vector<std::vector<size_t>> tasks(cluster_num);
+        // the K nearest clusters of every cluster before any epsilon pruning, which only
+        // depend on the clusters and K; relayout plans the file from these
+        std::vector<std::vector<size_t>> knn_tasks(config.relayout ? cluster_num : 0);
         graph->setEf(1000);
         int len = 500;
         std::vector<float> arcos_list(len + 1);
@@ -43,7 +58,12 @@ struct DiskJoin {
             int index = x*len/2 + len/2;
             return arcos_list[index];
         };
-#pragma omp parallel for
+        // a neighbor whose bounding box stays epsilon away from the box of the cluster
+        // cannot contribute any pair and is dropped from the task list
+        const float* box_min = cluster_reader.box_min.data();
+        const float* box_max = cluster_reader.box_max.data();
+        size_t box_pruned = 0;
+#pragma omp parallel for reduction(+:box_pruned)
         for (size_t i = 0; i < cluster_num; i++) {
             auto top_candidates = graph->knnSearchBaseLayer(i, config.K);
             std::vector<std::pair<float, unsigned>> dis_to_boundary;
@@ -54,6 +74,12 @@ struct DiskJoin {
                 dis_to_boundary.emplace_back(temp, neighbor_cluster);
             }
             std::sort(dis_to_boundary.begin(), dis_to_boundary.end());
+            if (config.relayout) {
+                for (auto& p : dis_to_boundary) {
+                    if (i <= p.second) knn_tasks[i].push_back(p.second);
+                }
+                std::sort(knn_tasks[i].begin(), knn_tasks[i].end());
+            }
             int ptr = dis_to_boundary.size() - 1;
             float sum_of_angle = 0;
             while (ptr >= 0) {
@@ -62,8 +88,13 @@ struct DiskJoin {
                 ptr--;
             }
             for (int ii = 0; ii <= ptr; ii++) {
-                if (i <= dis_to_boundary[ii].second) {
-                    tasks[i].push_back(dis_to_boundary[ii].second);
+                auto neighbor_cluster = dis_to_boundary[ii].second;
+                if (i < neighbor_cluster && utils::BoxL2Sqr(box_min + i * d, box_max + i * d, box_min + neighbor_cluster * d, box_max + neighbor_cluster * d, d) >= eps2 + margin) {
+                    box_pruned++;
+                    continue;
+                }
+                if (i <= neighbor_cluster) {
+                    tasks[i].push_back(neighbor_cluster);
                 }
             }
             std::sort(tasks[i].begin(), tasks[i].end());
@@ -92,67 +123,634 @@ struct DiskJoin {
             shuffled_tasks[i] = tasks[perm[i]];
         }
         size_t budget = (size_t)(config.mem_budget * 1024 * 1024 * 1024);
-        size_t length = cluster_reader.max_points * d;
-        perm = order_gorder(shuffled_tasks, budget / 4 / length / config.K * 2);
+        size_t vec_size = cluster_reader.vec_size;
+        size_t length = cluster_reader.max_points * vec_size;
+        perm = order_gorder(shuffled_tasks, budget / length / config.K * 2);
         for (size_t i = 0; i < cluster_num; i++) {
             reordered_tasks[perm[i]] = shuffled_tasks[i];
             order[perm[i]] = i;
         }
-        std::vector<float> data(max_task_num * length);
+        if (config.relayout) {
+            // store the clusters in the order a Gorder schedule of the K-NN lists first
+            // touches them, so the misses of consecutive targets tend to be close together on
+            // disk. The plan does not depend on epsilon, error_bound or mem_budget, so runs
+            // with other parameters keep the file as it is
+            std::vector<size_t> knn_perm = order_gorder(knn_tasks, config.K);
+            std::vector<size_t> knn_order(cluster_num);
+            for (size_t i = 0; i < cluster_num; i++) knn_order[knn_perm[i]] = i;
+            std::vector<size_t> first_use;
+            std::vector<bool> placed(cluster_num, false);
+            for (auto t : knn_order) {
+                for (auto id : knn_tasks[t]) {
+                    if (placed[id]) continue;
+                    placed[id] = true;
+                    first_use.push_back(id);
+                }
+            }
+            for (size_t i = 0; i < cluster_num; i++) {
+                if (!placed[i]) first_use.push_back(i);
+            }
+            if (first_use != cluster_reader.layout) {
+                cluster_reader.relayout(first_use);
+                std::cout << "clusters relaid out in schedule order" << std::endl;
+            }
+        }
+        if (!config.stripe_files.empty()) {
+            std::vector<std::string> files;
+            std::stringstream list(config.stripe_files);
+            std::string file;
+            while (std::getline(list, file, ',')) files.push_back(file);
+            cluster_reader.stripe(files);
+            std::cout << "clusters striped over " << files.size() << " files" << std::endl;
+        }
+        // clusters are used where they were read, in a cache slot or, when they are not
+        // cached, in a page aligned scratch slot; slot[k] points to the first vector of task k.
+        // The neighbors of a target are joined in passes of at most pass_size fetched clusters
+        // while the target stays resident, task k taking position pos[k] of the pass (the
+        // target 0), so the scratch and the per-task buffers hold pass_size + 1 clusters.
+        // The scratch counts toward mem_budget: without stream_slots it takes at most a
+        // quarter of it, and the cache gets what is left
+        size_t interleave_length = div_round_up(cluster_reader.max_points, INTERLEAVE_WIDTH) * INTERLEAVE_WIDTH * d;
+        size_t stride = cluster_reader.buffer_size + (config.interleave ? interleave_length * sizeof(float) : 0);
+        size_t pass_size = config.stream_slots > 0 ? config.stream_slots : std::max(budget / 4 / stride, (size_t)2) - 1;
+        pass_size = std::min(pass_size, max_task_num);
+        std::vector<char> scratch((pass_size + 1) * stride + PAGE_SIZE);
+        char* data = scratch.data() + (PAGE_SIZE - (uintptr_t)scratch.data() % PAGE_SIZE) % PAGE_SIZE;
+        std::vector<char*> slot(max_task_num);
+        std::vector<size_t> pos(max_task_num);
+        size_t passes = 0;
+
+        // reduced precision clusters are compared against an fp32 copy of the target point,
+        // pairs whose distance lies within the margin of epsilon are re-checked on the raw data.
+        // The kernel only collects them per thread; after each pass they are resolved in one
+        // batch that reads every vector involved once, in file order
+        auto dist_stored = utils::L2SqrStored(storage);
+        size_t elem_size = utils::storage_elem_size(storage);
+        DataReader raw_reader(config.data_file);
+        std::vector<float> thread_buffer(omp_get_max_threads() * d * 3);
+        size_t recheck = 0;
+        std::vector<std::vector<std::pair<size_t, size_t>>> borderline(omp_get_max_threads());
+        std::vector<std::pair<size_t, size_t>> borderline_pairs;
+        std::vector<size_t> borderline_ids;
+        std::vector<float> borderline_vecs;
+
+        // with SQ8 codes, pairs decided by the code bounds never touch the float vectors
+        // and a cluster is only fetched when some pair with it is still undecided
+        bool use_sq8 = config.code_file != "";
+        if (use_sq8) cluster_reader.mapCodes(config.code_file);
+        auto& sq = cluster_reader.sq;
+        auto decide = [&](const uint8_t* code1, const uint8_t* code2) -> int {
+            float lb, ub;
+            sq.bounds(code1, code2, lb, ub);
+            if (ub < eps2 - margin) return 1;
+            if (lb >= eps2 + margin) return -1;
+            return 0;
+        };
+        std::vector<char> undecided(max_task_num);
+        size_t fetched = 0, skipped = 0, decided = 0;
+
+        // head file: the first head_dims (most variant) dimensions of every point and the norm
+        // of the rest bound the distance by head + (|t1| - |t2|)^2 and head + (|t1| + |t2|)^2;
+        // like the codes they decide pairs before the cluster itself is fetched.
+        // The cluster file then holds only the other tail_dims dimensions, and a distance is
+        // the head part taken from the head file plus the tail part of the fetched cluster
+        bool use_head = config.head_file != "";
+        size_t head_dims = cluster_reader.head_dims;
+        if (head_dims > 0 && !use_head) {
+            std::cout << "the cluster file was split by a head file, set head_file" << std::endl;
+            exit(-1);
+        }
+        if (use_head) cluster_reader.mapHeads(config.head_file);
+        size_t tail_dims = d - head_dims;
+        auto decide_head = [&](const float* h1, const float* h2) -> int {
+            float head = dist_l2(h1, h2, &head_dims);
+            float lo = h1[head_dims] - h2[head_dims], hi = h1[head_dims] + h2[head_dims];
+            if (head + lo * lo >= eps2 + margin) return -1;
+            if (head + hi * hi < eps2 - margin) return 1;
+            return 0;
+        };
+        size_t head_decided = 0;
+        auto filter = [&](size_t c1, size_t j, size_t c2, size_t l, size_t& by_head) -> int {
+            int res = 0;
+            if (use_sq8) res = decide(cluster_reader.getCodes(c1) + j * d, cluster_reader.getCodes(c2) + l * d);
+            if (res == 0 && use_head) {
+                res = decide_head(cluster_reader.getHead(c1, j), cluster_reader.getHead(c2, l));
+                by_head += res != 0;
+            }
+            return res;
+        };
+
+        // 1-bit sketches reject pairs whose estimated distance stays above epsilon even after
+        // lowering the angle estimate by sketch_z standard deviations
+        bool use_sketch = config.sketch_file != "";
+        if (use_sketch) cluster_reader.readSketches(config.sketch_file, config.sketch_z);
+        auto& sketch = cluster_reader.sketch;
+        const uint64_t* sketch_codes = cluster_reader.sketch_codes.data();
+        const float* sketch_norms = cluster_reader.sketch_norms.data();
+        std::vector<float> sketch_buffer(use_sketch ? omp_get_max_threads() * (sketch.D + 2 * sketch.words) : 0);
+        size_t sketch_pruned = 0;
+
+        // points are sorted by distance to their centroid, so by the triangle inequality only a
+        // window of width 2 * epsilon around d(x, c) can match x
+        const float* centroid_dists = cluster_reader.centroid_dists.data();
+        float window = sqrt(eps2 + margin);
+        size_t window_skipped = 0;
+
+        // ball test: x cannot match any point of a neighbor cluster if d(x, c) - r >= epsilon
+        std::vector<float> task_centroids(max_task_num * d);
+        std::vector<float> task_radii(max_task_num);
+        std::vector<float> center_buffer(omp_get_max_threads() * max_task_num);
+        auto& radii = cluster_reader.radii;
+        size_t ball_skipped = 0, box_skipped = 0;
+
+        // early abandoning: the distance is summed early_abandon dimensions at a time, most
+        // variant dimensions first, and a pair is rejected once the partial sum passes epsilon
+        size_t chunk = config.early_abandon;
+        size_t abandoned = 0;
+
+        // interleaved layout: every fetched cluster is also kept as groups of 16 points stored
+        // dimension by dimension, and a target point is compared with a whole group at once;
+        // this path takes the place of the per-pair filters. The copy is made once, when the
+        // cluster is read, and lives right after its pages, in the cache extent (counted in the
+        // budget) or in the scratch slot; groups[k] points to the copy of task k
+        std::vector<float*> groups(max_task_num);
+        std::vector<char> fresh(max_task_num);
+
+        // the opposite test: if 2 * r < epsilon all pairs within a cluster match, and if
+        // d(c1, c2) + r1 + r2 < epsilon all pairs between two clusters do, so they are emitted
+        // in bulk and the clusters are not even fetched
+        float accept_radius = sqrt(std::max(eps2 - margin, 0.0f));
+        std::vector<char> accepted(max_task_num);
+        size_t task_accepted = 0, point_accepted = 0;
+        ResultSink sink;
+        if (config.output_file != "") sink.open(config.output_file);
+        // exact duplicates were collapsed at build time: the join runs on representatives, the
+        // sink expands their pairs to the groups, and the pairs inside a group are emitted here
+        if (!cluster_reader.group_offset.empty()) {
+            sink.set_groups(cluster_reader.group_offset.data(), cluster_reader.group_ids.data());
+            for (size_t id = 0; id < cluster_reader.n; id++) sink.emit_group(id);
+        }
+        auto resolve = [&]() {
+            borderline_pairs.clear();
+            for (auto& b : borderline) {
+                borderline_pairs.insert(borderline_pairs.end(), b.begin(), b.end());
+                b.clear();
+            }
+            if (borderline_pairs.empty()) return;
+            borderline_ids.clear();
+            for (auto& p : borderline_pairs) {
+                borderline_ids.push_back(p.first);
+                borderline_ids.push_back(p.second);
+            }
+            std::sort(borderline_ids.begin(), borderline_ids.end());
+            borderline_ids.erase(std::unique(borderline_ids.begin(), borderline_ids.end()), borderline_ids.end());
+            borderline_vecs.resize(borderline_ids.size() * d);
+            for (size_t t = 0; t < borderline_ids.size(); t++) raw_reader.read_vector(borderline_ids[t], borderline_vecs.data() + t * d);
+            auto vec_of = [&](size_t id) -> const float* {
+                return borderline_vecs.data() + (std::lower_bound(borderline_ids.begin(), borderline_ids.end(), id) - borderline_ids.begin()) * d;
+            };
+#pragma omp parallel for schedule(static)
+            for (size_t t = 0; t < borderline_pairs.size(); t++) {
+                auto& p = borderline_pairs[t];
+                if (dist_l2(vec_of(p.first), vec_of(p.second), &d) < eps2) sink.emit(p.first, p.second);
+            }
+        };
+
+        // the same two tests on pairs of micro-blocks, settled per target before any point is
+        // visited; block_status holds one entry per (target block, neighbor block) of each task
+        auto& block_offset = cluster_reader.block_offset;
+        const size_t* block_starts = cluster_reader.block_starts.data();
+        const float* block_centroids = cluster_reader.block_centroids.data();
+        const float* block_radii = cluster_reader.block_radii.data();
+        std::vector<char> block_status;
+        std::vector<size_t> status_offset(max_task_num);
+        std::vector<size_t> point_block(cluster_reader.max_points);
+        size_t block_pruned = 0, block_accepted = 0;
+
+        // sort-and-sweep: for a cross task, points of both clusters are projected on the axis
+        // from c_T to c_N and only neighbors whose projection is within epsilon of the target
+        // point's are visited; used when the exact share of such pairs is below sweep_threshold
+        size_t max_points = cluster_reader.max_points;
+        std::vector<char> use_sweep(max_task_num);
+        std::vector<float> target_proj((pass_size + 1) * max_points);
+        std::vector<std::pair<float, unsigned>> sweep_order((pass_size + 1) * max_points);
+        std::vector<float> sweep_proj((pass_size + 1) * max_points);
+        size_t swept = 0;
 
         float io_size = 0;
 
-        Cache cache(budget, length);
+        // the clusters missing from the cache are read in one batch per target
+        // the mmap backend leaves caching to the page cache: clusters are used in place from
+        // the mapping, the ones of the target lookahead steps ahead are requested with
+        // MADV_WILLNEED and a cluster is dropped with MADV_DONTNEED after its last use
+        bool use_mmap = config.io_backend == "mmap";
+        size_t lookahead = std::max(config.prefetch_depth, (size_t)1);
+        std::vector<size_t> last_use;
+        if (use_mmap) {
+            cluster_reader.mapClusters();
+            last_use.assign(cluster_num, 0);
+            for (size_t i = 0; i < cluster_num; i++) {
+                for (auto id : reordered_tasks[i]) last_use[id] = i;
+            }
+        }
+        if (config.io_backend == "uring") cluster_reader.initUring(config.io_depth);
+        else if (config.io_backend != "posix" && !use_mmap) {
+            std::cout << "unknown io backend: " << config.io_backend << std::endl;
+            exit(-1);
+        }
+        // reading across a gap pays off while transferring it takes less time than one more
+        // request, so the gap allowed between coalesced clusters is seek time x bandwidth
+        cluster_reader.setCoalesceGap((size_t)(config.seek_us * config.read_mbps) / PAGE_SIZE * PAGE_SIZE);
+        std::vector<size_t> miss_ids(max_task_num);
+        std::vector<char*> miss_slots(max_task_num);
+
+        size_t scratch_bytes = scratch.size() + cluster_reader.coalesce_gap;
+        Cache cache(use_mmap ? 0 : budget - std::min(budget, scratch_bytes));
         cache.init(reordered_tasks);
+
+        // cache extent of a cluster: its pages and, with interleave, its AoSoA copy
+        auto cache_bytes = [&](size_t id) -> size_t {
+            if (config.interleave) return cluster_reader.readSize(id) + cluster_reader.interleavedSize(id);
+            return cluster_reader.pageOffset(id) + bucket_sizes[id] * vec_size;
+        };
+        // with prefetch_depth > 0 the clusters of the target prefetch_depth steps ahead that
+        // are not cached yet get a reserved cache extent and are read on a separate thread
+        // while the current target is joined. Only clusters not needed before that target are
+        // reserved, so nothing reads an extent before its batch is in
+        std::unique_ptr<Prefetcher> prefetcher;
+        if (config.prefetch_depth > 0 && !use_mmap) prefetcher.reset(new Prefetcher(cluster_reader, config.prefetch_depth));
+        std::vector<size_t> task_start(cluster_num + 1, 0);
+        for (size_t i = 0; i < cluster_num; i++) task_start[i + 1] = task_start[i] + reordered_tasks[i].size();
+        std::vector<size_t> prefetch_ids;
+        std::vector<char*> prefetch_bases;
+        std::vector<char> was_prefetched(cluster_num, 0);
+        size_t prefetched = 0;
+        auto request = [&](size_t i) {
+            prefetch_ids.clear();
+            prefetch_bases.clear();
+            for (auto id : reordered_tasks[i]) {
+                if (cache.contains(id)) continue;
+                char* base = cache.reserve(id, cache_bytes(id), task_start[i]);
+                if (base == nullptr) continue;
+                prefetch_ids.push_back(id);
+                prefetch_bases.push_back(base);
+            }
+            prefetcher->request(i, prefetch_ids, prefetch_bases);
+        };
+        // the batch of the i-th target is in: its extents become ordinary cache entries
+        auto finish = [&](size_t i) {
+            auto& stage = prefetcher->wait(i);
+            for (auto id : stage.ids) {
+                cache.unreserve(id);
+                was_prefetched[id] = 1;
+            }
+            if (!config.interleave) return;
+#pragma omp parallel for schedule(dynamic)
+            for (size_t j = 0; j < stage.ids.size(); j++) {
+                auto id = stage.ids[j];
+                cluster_reader.interleaveCluster(id, stage.bases[j] + cluster_reader.pageOffset(id), (float*)(stage.bases[j] + cluster_reader.readSize(id)), thread_buffer.data() + omp_get_thread_num() * d * 3);
+            }
+        };
+        if (prefetcher) {
+            for (size_t i = 0; i < std::min(config.prefetch_depth, cluster_num); i++) request(i);
+        }
         float sum = 0;
-        size_t count = 0;
         float disk_time = 0;
         float comp_time = 0;
         float dist_comp = 0;
         for (size_t i = 0; i < cluster_num; i++) {
             auto target_cluster = order[i];
             auto& target_tasks = reordered_tasks[i];
-            for (size_t j = 0; j < target_tasks.size(); j++) {
-                auto neighbor_cluster = target_tasks[j];
-                if (!cache.find(neighbor_cluster, data.data() + j * length, cluster_reader.bucket_sizes[neighbor_cluster] * d)) {
-                    cluster_reader.posixDirectReadCluster(neighbor_cluster, data.data() + j * length);
-                    cache.push(neighbor_cluster, data.data() + j * length, cluster_reader.bucket_sizes[neighbor_cluster] * d);
+            if (prefetcher) {
+                finish(i);
+                if (i + config.prefetch_depth < cluster_num) request(i + config.prefetch_depth);
+            }
+            if (use_mmap) {
+                for (size_t t = i == 0 ? 0 : i + lookahead; t <= std::min(i + lookahead, cluster_num - 1); t++) {
+                    for (auto id : reordered_tasks[t]) cluster_reader.adviseCluster(id, MADV_WILLNEED);
+                }
+                if (i > 0) {
+                    for (auto id : reordered_tasks[i - 1]) {
+                        if (last_use[id] == i - 1) cluster_reader.adviseCluster(id, MADV_DONTNEED);
+                    }
                 }
             }
-            
-            if (bucket_sizes[target_cluster] == 0) continue;
-#pragma omp parallel for schedule(dynamic) reduction(+:sum) reduction(+:count) reduction(+:dist_comp)
-            for (size_t j = 0; j < bucket_sizes[target_cluster]; j++) {
-                auto id1 = assignment[target_cluster][j];
-                float* vec1 = data.data() + j * d;
-                for (size_t l = 0; l < bucket_sizes[target_cluster]; l++) {
-                    auto id2 = assignment[target_cluster][l];
-                    if (id2 >= id1) continue;
-                    float* vec2 = data.data() + l * d;
-                    float dist = dist_l2(vec1, vec2, &d);
-                    dist_comp++;
-                    if (dist < epsilon * epsilon) {
-                        if (id1 % 100000 == 0) count++;
-                        if (id2 % 100000 == 0) count++;
+            for (size_t k = 0; k < target_tasks.size(); k++) {
+                auto neighbor_cluster = target_tasks[k];
+                float bound = 2 * radii[target_cluster];
+                if (k > 0) bound = sqrt(dist_l2(centroids + target_cluster * d, centroids + neighbor_cluster * d, &d)) + radii[target_cluster] + radii[neighbor_cluster];
+                accepted[k] = bucket_sizes[target_cluster] > 0 && bound < accept_radius;
+                if (!accepted[k]) continue;
+                task_accepted++;
+                auto& ids = assignment[target_cluster];
+                if (k == 0) sink.emit_all(ids.data(), ids.size());
+                else sink.emit_cross(ids.data(), ids.size(), assignment[neighbor_cluster].data(), bucket_sizes[neighbor_cluster]);
+            }
+            size_t target_blocks = block_offset[target_cluster + 1] - block_offset[target_cluster];
+            size_t status_size = 0;
+            for (size_t k = 0; k < target_tasks.size(); k++) {
+                status_offset[k] = status_size;
+                status_size += target_blocks * (block_offset[target_tasks[k] + 1] - block_offset[target_tasks[k]]);
+            }
+            if (block_status.size() < status_size) block_status.resize(status_size);
+            for (size_t b = 0; b < target_blocks; b++) {
+                auto g = block_offset[target_cluster] + b;
+                for (size_t j = block_starts[g]; j < cluster_reader.blockEnd(target_cluster, g); j++) point_block[j] = b;
+            }
+#pragma omp parallel for schedule(dynamic) reduction(+:block_pruned) reduction(+:block_accepted)
+            for (size_t k = 0; k < target_tasks.size(); k++) {
+                undecided[k] = 0;
+                if (accepted[k]) continue;
+                auto neighbor_cluster = target_tasks[k];
+                auto& ids1 = assignment[target_cluster];
+                auto& ids2 = assignment[neighbor_cluster];
+                size_t neighbor_blocks = block_offset[neighbor_cluster + 1] - block_offset[neighbor_cluster];
+                char* status = block_status.data() + status_offset[k];
+                for (size_t b1 = 0; b1 < target_blocks; b1++) {
+                    auto g1 = block_offset[target_cluster] + b1;
+                    for (size_t b2 = 0; b2 < neighbor_blocks; b2++) {
+                        auto g2 = block_offset[neighbor_cluster] + b2;
+                        float dc = k == 0 && b1 == b2 ? 0 : sqrt(dist_l2(block_centroids + g1 * d, block_centroids + g2 * d, &d));
+                        auto& st = status[b1 * neighbor_blocks + b2];
+                        if (dc - block_radii[g1] - block_radii[g2] >= window) {
+                            st = BLOCK_PRUNED;
+                            block_pruned++;
+                        } else if (dc + block_radii[g1] + block_radii[g2] < accept_radius) {
+                            st = BLOCK_ACCEPTED;
+                            block_accepted++;
+                            auto s1 = block_starts[g1], e1 = cluster_reader.blockEnd(target_cluster, g1);
+                            auto s2 = block_starts[g2], e2 = cluster_reader.blockEnd(neighbor_cluster, g2);
+                            if (k == 0 && b1 == b2) sink.emit_all(ids1.data() + s1, e1 - s1);
+                            else if (k > 0 || b1 < b2) sink.emit_cross(ids1.data() + s1, e1 - s1, ids2.data() + s2, e2 - s2);
+                        } else {
+                            st = BLOCK_COMPUTE;
+                            undecided[k] = 1;
+                        }
                     }
                 }
-
-                for (int k = 1; k < target_tasks.size(); k++) {
+            }
+            if (use_sq8 || use_head) {
+                auto& ids = assignment[target_cluster];
+#pragma omp parallel for schedule(dynamic)
+                for (size_t k = 0; k < target_tasks.size(); k++) {
+                    if (!undecided[k]) continue;
                     auto neighbor_cluster = target_tasks[k];
-                    float dist = dist_l2(vec1, centroids + neighbor_cluster * d, &d);
-                    for (size_t l = 0; l < bucket_sizes[neighbor_cluster]; l++) {
+                    size_t by_head = 0;
+                    size_t neighbor_blocks = block_offset[neighbor_cluster + 1] - block_offset[neighbor_cluster];
+                    const char* status = block_status.data() + status_offset[k];
+                    undecided[k] = 0;
+                    for (size_t j = 0; j < bucket_sizes[target_cluster] && !undecided[k]; j++) {
+                        for (size_t b = 0; b < neighbor_blocks && !undecided[k]; b++) {
+                            if (status[point_block[j] * neighbor_blocks + b] != BLOCK_COMPUTE) continue;
+                            auto g = block_offset[neighbor_cluster] + b;
+                            for (size_t l = block_starts[g]; l < cluster_reader.blockEnd(neighbor_cluster, g); l++) {
+                                if (k == 0 && ids[l] >= ids[j]) continue;
+                                if (filter(target_cluster, j, neighbor_cluster, l, by_head) == 0) {
+                                    undecided[k] = 1;
+                                    break;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+            for (size_t k = 1; k < target_tasks.size(); k++) {
+                if (undecided[k]) undecided[0] = 1;
+            }
+            cache.release();
+            size_t next = 0;
+            while (next < target_tasks.size()) {
+                size_t pass_begin = next, members = 0, miss_num = 0;
+                for (; next < target_tasks.size(); next++) {
+                    size_t j = next;
+                    auto neighbor_cluster = target_tasks[j];
+                    if (!undecided[j]) {
+                        cache.skip(neighbor_cluster);
+                        skipped++;
+                        continue;
+                    }
+                    if (j > 0 && members == pass_size) break;
+                    pos[j] = j == 0 ? 0 : ++members;
+                    fetched++;
+                    fresh[j] = 1;
+                    if (use_mmap) {
+                        slot[j] = cluster_reader.mappedCluster(neighbor_cluster);
+                        groups[j] = (float*)(data + pos[j] * stride + cluster_reader.buffer_size);
+                        continue;
+                    }
+                    char* base = cache.find(neighbor_cluster);
+                    if (base != nullptr) {
+                        fresh[j] = 0;
+                        prefetched += was_prefetched[neighbor_cluster];
+                        was_prefetched[neighbor_cluster] = 0;
+                    } else {
+                        was_prefetched[neighbor_cluster] = 0;
+                        base = cache.push(neighbor_cluster, cache_bytes(neighbor_cluster));
+                        if (base == nullptr) base = data + pos[j] * stride;
+                        miss_ids[miss_num] = neighbor_cluster;
+                        miss_slots[miss_num++] = base;
+                    }
+                    slot[j] = base + cluster_reader.pageOffset(neighbor_cluster);
+                    groups[j] = (float*)(base + cluster_reader.readSize(neighbor_cluster));
+                }
+                cluster_reader.readClusters(miss_ids.data(), miss_slots.data(), miss_num);
+                passes++;
+                
+                if (config.interleave) {
+#pragma omp parallel for schedule(dynamic)
+                    for (size_t k = pass_begin; k < next; k++) {
+                        if (!undecided[k] || !fresh[k]) continue;
+                        cluster_reader.interleaveCluster(target_tasks[k], slot[k], groups[k], thread_buffer.data() + omp_get_thread_num() * d * 3);
+                    }
+                }
+                if (bucket_sizes[target_cluster] == 0) continue;
+                for (size_t k = pass_begin; k < next; k++) {
+                    memcpy(task_centroids.data() + k * d, centroids + target_tasks[k] * d, d * sizeof(float));
+                    task_radii[k] = radii[target_tasks[k]];
+                }
+#pragma omp parallel for schedule(dynamic) reduction(+:swept)
+                for (size_t k = std::max(pass_begin, (size_t)1); k < next; k++) {
+                    use_sweep[k] = 0;
+                    if (config.sweep_threshold <= 0 || !undecided[k] || accepted[k]) continue;
+                    auto neighbor_cluster = target_tasks[k];
+                    float* axis = thread_buffer.data() + omp_get_thread_num() * d * 3;
+                    float* vec = axis + d;
+                    float norm = 0;
+                    for (size_t t = 0; t < d; t++) {
+                        axis[t] = centroids[neighbor_cluster * d + t] - centroids[target_cluster * d + t];
+                        norm += axis[t] * axis[t];
+                    }
+                    if (norm == 0) continue;
+                    norm = 1 / sqrt(norm);
+                    for (size_t t = 0; t < d; t++) axis[t] *= norm;
+                    auto project = [&](size_t c, size_t l, const char* stored) -> float {
+                        cluster_reader.decodePoint(c, l, stored, vec);
+                        return utils::IPNaive<float>(vec, axis, &d);
+                    };
+                    auto* order_k = sweep_order.data() + pos[k] * max_points;
+                    float* proj = sweep_proj.data() + pos[k] * max_points;
+                    size_t size = bucket_sizes[neighbor_cluster];
+                    for (size_t l = 0; l < size; l++) order_k[l] = std::make_pair(project(neighbor_cluster, l, slot[k]), (unsigned)l);
+                    std::sort(order_k, order_k + size);
+                    for (size_t l = 0; l < size; l++) proj[l] = order_k[l].first;
+                    size_t candidates = 0;
+                    for (size_t j = 0; j < bucket_sizes[target_cluster]; j++) {
+                        float p = project(target_cluster, j, slot[0]);
+                        target_proj[pos[k] * max_points + j] = p;
+                        candidates += std::upper_bound(proj, proj + size, p + window) - std::lower_bound(proj, proj + size, p - window);
+                    }
+                    use_sweep[k] = candidates < config.sweep_threshold * bucket_sizes[target_cluster] * size;
+                    swept += use_sweep[k];
+                }
+#pragma omp parallel for schedule(dynamic) reduction(+:sum) reduction(+:dist_comp) reduction(+:recheck) reduction(+:decided) reduction(+:sketch_pruned) reduction(+:window_skipped) reduction(+:ball_skipped) reduction(+:box_skipped) reduction(+:point_accepted) reduction(+:abandoned) reduction(+:head_decided)
+                for (size_t j = 0; j < bucket_sizes[target_cluster]; j++) {
+                    auto id1 = assignment[target_cluster][j];
+                    float* vec1 = thread_buffer.data() + omp_get_thread_num() * d * 3 + 2 * d;
+                    if (storage == utils::STORAGE_FP32 && head_dims == 0) vec1 = (float*)(slot[0] + j * vec_size);
+                    else if (undecided[0]) cluster_reader.decodePoint(target_cluster, j, slot[0], vec1);
+                    float* rotated = sketch_buffer.data() + omp_get_thread_num() * (sketch.D + 2 * sketch.words);
+                    uint64_t* qcode = (uint64_t*)(rotated + sketch.D);
+                    float* center_dist = center_buffer.data() + omp_get_thread_num() * max_task_num;
+                    if (undecided[0]) {
+                        utils::L2SqrBatch(vec1, task_centroids.data() + pass_begin * d, next - pass_begin, d, center_dist + pass_begin);
+#pragma omp simd
+                        for (size_t k = pass_begin; k < next; k++) center_dist[k] = sqrt(center_dist[k]);
+                    }
+                    float qnorm = -1;
+                    auto check = [&](size_t id2, float dist1) {
+                        if (margin != 0 && fabs(dist1 - eps2) <= margin) {
+                            recheck++;
+                            borderline[omp_get_thread_num()].push_back(std::make_pair(id1, id2));
+                        } else if (dist1 < eps2) {
+                            sink.emit(id1, id2);
+                        }
+                    };
+                    auto visit = [&](size_t k, size_t neighbor_cluster, size_t l) {
                         auto id2 = assignment[neighbor_cluster][l];
-                        float* vec2 = data.data() + k * length + l * d;
-                        float dist1 = dist_l2(vec1, vec2, &d);
+                        if (k == 0 && id2 >= id1) return;
+                        if (use_sq8 || use_head) {
+                            int res = filter(target_cluster, j, neighbor_cluster, l, head_decided);
+                            decided += res != 0;
+                            if (res == -1) return;
+                            if (res == 1) {
+                                sink.emit(id1, id2);
+                                return;
+                            }
+                        }
+                        if (use_sketch) {
+                            if (qnorm < 0) qnorm = sketch.encode(vec1, centroids + neighbor_cluster * d, rotated, qcode);
+                            size_t pos = cluster_reader.point_pos[neighbor_cluster] + l;
+                            if (sketch.lower_bound(qcode, qnorm, sketch_codes + pos * sketch.words, sketch_norms[pos]) >= eps2) {
+                                sketch_pruned++;
+                                return;
+                            }
+                        }
+                        char* vec2 = slot[k] + l * vec_size;
+                        float head = head_dims > 0 ? dist_l2(vec1, cluster_reader.getHead(neighbor_cluster, l), &head_dims) : 0;
+                        float dist1 = head + (chunk ? utils::L2SqrAbandon(dist_stored, vec1 + head_dims, vec2, tail_dims, elem_size, chunk, eps2 + margin - head) : dist_stored(vec1 + head_dims, vec2, &tail_dims));
                         dist_comp++;
-                        if (dist1 < epsilon * epsilon) {
-                            if (id1 % 100000 == 0) count++;
-                            if (id2 % 100000 == 0) count++;
-                        };
+                        if (chunk && dist1 >= eps2 + margin) abandoned++;
+                        check(id2, dist1);
+                    };
+                    for (size_t k = pass_begin; k < next; k++) {
+                        auto neighbor_cluster = target_tasks[k];
+                        if (accepted[k]) continue;
+                        qnorm = -1;
+                        bool all_match = false;
+                        const float* dists = centroid_dists + cluster_reader.point_pos[neighbor_cluster];
+                        if (undecided[0]) {
+                            if (center_dist[k] - task_radii[k] >= window) {
+                                ball_skipped++;
+                                continue;
+                            }
+                            if (k > 0 && utils::PointBoxL2Sqr(vec1, box_min + neighbor_cluster * d, box_max + neighbor_cluster * d, d) >= eps2 + margin) {
+                                box_skipped++;
+                                continue;
+                            }
+                            if (k > 0 && center_dist[k] + task_radii[k] < accept_radius) {
+                                all_match = true;
+                                point_accepted++;
+                            }
+                        }
+                        size_t neighbor_blocks = block_offset[neighbor_cluster + 1] - block_offset[neighbor_cluster];
+                        const char* status = block_status.data() + status_offset[k] + point_block[j] * neighbor_blocks;
+                        if (use_sweep[k] && !all_match) {
+                            size_t size = bucket_sizes[neighbor_cluster];
+                            const float* proj = sweep_proj.data() + pos[k] * max_points;
+                            const auto* order_k = sweep_order.data() + pos[k] * max_points;
+                            float p = target_proj[pos[k] * max_points + j];
+                            size_t begin = std::lower_bound(proj, proj + size, p - window) - proj;
+                            size_t end = std::upper_bound(proj + begin, proj + size, p + window) - proj;
+                            window_skipped += size - (end - begin);
+                            for (size_t t = begin; t < end; t++) {
+                                auto l = order_k[t].second;
+                                if (fabs(dists[l] - center_dist[k]) > window) continue;
+                                if (status[cluster_reader.blockOf(neighbor_cluster, l) - block_offset[neighbor_cluster]] != BLOCK_COMPUTE) continue;
+                                visit(k, neighbor_cluster, l);
+                            }
+                            continue;
+                        }
+                        for (size_t b = 0; b < neighbor_blocks; b++) {
+                            if (status[b] != BLOCK_COMPUTE) continue;
+                            auto g = block_offset[neighbor_cluster] + b;
+                            size_t begin = block_starts[g], end = cluster_reader.blockEnd(neighbor_cluster, g);
+                            if (all_match) {
+                                sink.emit_cross(&id1, 1, assignment[neighbor_cluster].data() + begin, end - begin);
+                                continue;
+                            }
+                            if (undecided[0]) {
+                                size_t block_size = end - begin;
+                                begin = std::lower_bound(dists + begin, dists + end, center_dist[k] - window) - dists;
+                                end = std::upper_bound(dists + begin, dists + end, center_dist[k] + window) - dists;
+                                window_skipped += block_size - (end - begin);
+                            }
+                            if (config.interleave && undecided[0] && undecided[k]) {
+                                float group_dist[INTERLEAVE_WIDTH];
+                                const size_t* ids2 = assignment[neighbor_cluster].data();
+                                for (size_t t = begin / INTERLEAVE_WIDTH * INTERLEAVE_WIDTH; t < end; t += INTERLEAVE_WIDTH) {
+                                    utils::L2SqrInterleaved16(vec1, groups[k] + t * d, d, group_dist);
+                                    size_t lo = std::max(t, begin) - t, hi = std::min(t + INTERLEAVE_WIDTH, end) - t;
+                                    uint32_t lanes = ((1u << hi) - 1) & ~((1u << lo) - 1);
+                                    if (k == 0) {
+                                        for (size_t l = lo; l < hi; l++) lanes &= ~((uint32_t)(ids2[t + l] >= id1) << l);
+                                    }
+                                    dist_comp += __builtin_popcount(lanes);
+                                    // lanes below eps^2 - margin match for sure, those up to
+                                    // eps^2 + margin go through the recheck
+                                    uint32_t sure = lanes & utils::LessMask16(group_dist, eps2 - margin);
+                                    uint32_t maybe = lanes & ~sure & utils::LessMask16(group_dist, eps2 + margin, true);
+                                    sink.emit_mask(id1, ids2 + t, sure);
+                                    for (; maybe; maybe &= maybe - 1) {
+                                        size_t l = __builtin_ctz(maybe);
+                                        check(ids2[t + l], group_dist[l]);
+                                    }
+                                }
+                                continue;
+                            }
+                            for (size_t l = begin; l < end; l++) visit(k, neighbor_cluster, l);
+                        }
                     }
                 }
+                resolve();
             }
         }
-        std::cout << "recall = " << 1.0 * count / config.gt << "\n";
+        sink.close();
+        if (margin != 0) std::cout << "rechecked pairs = " << recheck << "\n";
+        if (use_sq8) std::cout << "pairs decided by codes = " << decided - head_decided << ", exact = " << dist_comp << "\n";
+        if (use_head) std::cout << "pairs decided by heads = " << head_decided << "\n";
+        std::cout << "cluster fetches = " << fetched << ", skipped = " << skipped << "\n";
+        std::cout << "read requests = " << cluster_reader.reads << ", join passes = " << passes << "\n";
+        if (cluster_reader.used > 0) std::cout << "bytes read = " << cluster_reader.total << ", used = " << cluster_reader.used << ", amplification = " << cluster_reader.total / cluster_reader.used << "\n";
+        if (prefetcher) std::cout << "clusters prefetched = " << prefetcher->staged << ", used = " << prefetched << "\n";
+        std::cout << "block pairs pruned = " << block_pruned << ", accepted = " << block_accepted << "\n";
+        if (use_sketch) std::cout << "pairs pruned by sketches = " << sketch_pruned << "\n";
+        std::cout << "tasks joined by sort-and-sweep = " << swept << "\n";
+        std::cout << "tasks pruned by bounding boxes = " << box_pruned << "\n";
+        std::cout << "neighbor clusters skipped by ball test = " << ball_skipped << ", by bounding box = " << box_skipped << "\n";
+        std::cout << "pairs skipped by centroid distance window = " << window_skipped << ", distance computations = " << dist_comp << "\n";
+        if (chunk) std::cout << "distance computations abandoned early = " << abandoned << "\n";
+        std::cout << "tasks accepted whole = " << task_accepted << ", target points accepted against a whole neighbor = " << point_accepted << "\n";
+        std::cout << "pairs = " << sink.pairs() << "\n";
+        std::cout << "recall = " << 1.0 * sink.sampled() / config.gt << "\n";
     }
 };
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring driver on the raw system calls: one submission and one completion ring
+// and a table of registered files, enough for batches of vectored reads.
+struct IoUring {
+    int ring_fd;
+    unsigned entries;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned queued;
+
+    IoUring(): ring_fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes((io_uring_sqe*)MAP_FAILED), queued(0) {}
+
+    bool init(unsigned depth) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+        if (ring_fd < 0) return false;
+        entries = p.sq_entries;
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) return false;
+        cq_ptr = single ? sq_ptr : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) return false;
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+        sq_tail = (unsigned*)((char*)sq_ptr + p.sq_off.tail);
+        sq_mask = (unsigned*)((char*)sq_ptr + p.sq_off.ring_mask);
+        sq_array = (unsigned*)((char*)sq_ptr + p.sq_off.array);
+        cq_head = (unsigned*)((char*)cq_ptr + p.cq_off.head);
+        cq_tail = (unsigned*)((char*)cq_ptr + p.cq_off.tail);
+        cq_mask = (unsigned*)((char*)cq_ptr + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)((char*)cq_ptr + p.cq_off.cqes);
+        return true;
+    }
+
+    bool register_files(const int* fds, unsigned n) {
+        return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, fds, n) == 0;
+    }
+
+    // queues a vectored read of registered file `file` at offset into the n buffers of iov,
+    // which must stay valid until submit_and_wait returns; fewer than expect bytes is an error
+    void readv(const iovec* iov, unsigned n, size_t offset, unsigned file, size_t expect) {
+        if (queued == entries) submit_and_wait();
+        unsigned tail = *sq_tail;
+        unsigned idx = tail & *sq_mask;
+        io_uring_sqe* sqe = sqes + idx;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = file;
+        sqe->addr = (uint64_t)iov;
+        sqe->len = n;
+        sqe->off = offset;
+        sqe->user_data = expect;
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+    }
+
+    // submits everything queued and waits until all of it has completed
+    void submit_and_wait() {
+        if (queued == 0) return;
+        auto ret = syscall(__NR_io_uring_enter, ring_fd, queued, queued, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0) {
+            std::cout << "io_uring submit error" << std::endl;
+            exit(-1);
+        }
+        unsigned done = 0;
+        while (done < queued) {
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                syscall(__NR_io_uring_enter, ring_fd, 0, queued - done, IORING_ENTER_GETEVENTS, nullptr, 0);
+                continue;
+            }
+            for (; head != tail; head++, done++) {
+                io_uring_cqe* cqe = cqes + (head & *cq_mask);
+                if (cqe->res < 0) {
+                    std::cout << "io_uring read error: " << strerror(-cqe->res) << std::endl;
+                    exit(-1);
+                }
+                if ((uint64_t)cqe->res < cqe->user_data) {
+                    std::cout << "io_uring short read" << std::endl;
+                    exit(-1);
+                }
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        queued = 0;
+    }
+
+    ~IoUring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+};
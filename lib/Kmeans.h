@@ -213,7 +213,14 @@ void one_level_kmeans(ConfigReader config) {
             kmeans.add2choice(num, data_buffer.data(), ids, graph);
         }
     }
-    ClusterWriter cluster_writer(datafile, config.cluster_file, config.metadata_file);
+    ClusterWriter cluster_writer(datafile, config.cluster_file, config.metadata_file, utils::parse_storage(config.storage));
+    if (config.early_abandon > 0 || config.head_file != "") cluster_writer.orderDimensions();
     cluster_writer.writeClusters(kmeans.inverted_list_, kmeans.centroids_.data(), config.mem_budget);
+    if (config.dedup) cluster_writer.dedupClusters(kmeans.inverted_list_);
+    cluster_writer.sortClusters(kmeans.inverted_list_, config.block_size);
+    if (config.code_file != "") cluster_writer.writeCodes(config.code_file);
+    if (config.sketch_file != "") cluster_writer.writeSketches(config.sketch_file);
+    if (config.head_file != "") cluster_writer.writeHeads(config.head_file, config.head_dims);
+    if (config.align_clusters) cluster_writer.alignClusters();
     cluster_writer.writeMetadata(kmeans.inverted_list_);
 }
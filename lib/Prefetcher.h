@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "ClusterIO.h"
+
+// Reads the clusters of upcoming targets on its own thread, so disk time overlaps with the
+// join of the current target. The join reserves a cache extent for every cluster of the
+// target depth steps ahead that is not cached yet and requests them as one stage. Each of
+// the depth + 1 stages holds the misses of one target; the thread drains every queued stage
+// into one readClusters call (coalesced, and with io_uring up to io_depth reads in flight),
+// which reads straight into the extents. The join waits for a stage when it reaches that
+// target.
+struct Prefetcher {
+    struct Stage {
+        std::vector<size_t> ids;
+        std::vector<char*> bases;
+        bool ready;
+    };
+
+    ClusterReader& reader;
+    size_t depth;
+    std::vector<Stage> stages;
+    std::deque<size_t> requests;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop;
+    std::thread worker;
+    size_t staged;
+
+    Prefetcher(ClusterReader& reader, size_t depth):
+        reader(reader), depth(depth), stages(depth + 1), stop(false), staged(0) {
+        for (auto& s : stages) s.ready = true;
+        worker = std::thread(&Prefetcher::run, this);
+    }
+
+    // stage of the i-th target in the join order
+    size_t stage(size_t i) {
+        return i % (depth + 1);
+    }
+
+    // reads ids[j] into the reserved extent bases[j] for the i-th target
+    void request(size_t i, const std::vector<size_t>& ids, const std::vector<char*>& bases) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto& s = stages[stage(i)];
+        // the stage may still be filled for a target that never waited on it
+        cv.wait(lock, [&] { return s.ready; });
+        s.ids = ids;
+        s.bases = bases;
+        s.ready = false;
+        requests.push_back(stage(i));
+        cv.notify_all();
+    }
+
+    // waits until the batch of the i-th target is in its extents and returns it
+    const Stage& wait(size_t i) {
+        auto& s = stages[stage(i)];
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return s.ready; });
+        return s;
+    }
+
+    void run() {
+        std::vector<size_t> batch, ids;
+        std::vector<char*> bases;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stop || !requests.empty(); });
+                if (stop) return;
+                batch.assign(requests.begin(), requests.end());
+                requests.clear();
+            }
+            // the stages are not touched by the join until they are ready again
+            ids.clear();
+            bases.clear();
+            for (auto st : batch) {
+                ids.insert(ids.end(), stages[st].ids.begin(), stages[st].ids.end());
+                bases.insert(bases.end(), stages[st].bases.begin(), stages[st].bases.end());
+            }
+            reader.readClusters(ids.data(), bases.data(), ids.size());
+            std::lock_guard<std::mutex> lock(mutex);
+            staged += ids.size();
+            for (auto st : batch) stages[st].ready = true;
+            cv.notify_all();
+        }
+    }
+
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            cv.notify_all();
+        }
+        worker.join();
+    }
+};
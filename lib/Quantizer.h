@@ -0,0 +1,132 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+// 8-bit scalar quantizer with a per-dimension [min, max] range shared by all clusters,
+// so codes of any two points can be compared directly.
+struct ScalarQuantizer {
+    size_t d;
+    std::vector<float> vmin;
+    std::vector<float> step;
+    std::vector<float> inv_step;
+    std::vector<float> step2;
+
+    ScalarQuantizer() = default;
+
+    ScalarQuantizer(size_t d, const float* lo, const float* hi): d(d), vmin(lo, lo + d), step(d) {
+        for (size_t i = 0; i < d; i++) step[i] = (hi[i] - lo[i]) / 255;
+        init();
+    }
+
+    void init() {
+        inv_step.resize(d);
+        step2.resize(d);
+        for (size_t i = 0; i < d; i++) {
+            inv_step[i] = step[i] > 0 ? 1 / step[i] : 0;
+            step2[i] = step[i] * step[i];
+        }
+    }
+
+    void encode(const float* x, uint8_t* code) const {
+        for (size_t i = 0; i < d; i++) {
+            float v = std::round((x[i] - vmin[i]) * inv_step[i]);
+            code[i] = v < 0 ? 0 : (v > 255 ? 255 : (uint8_t)v);
+        }
+    }
+
+    // every value lies within half a step of its code, so a code difference of a
+    // bounds the true difference by (a - 1) * step and (a + 1) * step
+    inline void bounds(const uint8_t* x, const uint8_t* y, float& lb, float& ub) const {
+        const float* w = step2.data();
+        float l = 0, u = 0;
+#pragma omp simd reduction(+:l, u)
+        for (size_t i = 0; i < d; i++) {
+            float a = std::fabs((float)x[i] - (float)y[i]);
+            float lo = a > 1 ? a - 1 : 0;
+            l += lo * lo * w[i];
+            u += (a + 1) * (a + 1) * w[i];
+        }
+        lb = l;
+        ub = u;
+    }
+};
+
+// 1-bit code of the residual to the cluster centroid after a randomized Hadamard rotation.
+// The Hamming distance between two codes estimates the angle between the residuals, and
+// together with the residual norms it gives a probabilistic lower bound on the distance.
+struct SignSketch {
+    size_t d;
+    size_t D;
+    size_t words;
+    std::vector<float> signs;
+    std::vector<float> cos_lo;
+
+    SignSketch() = default;
+
+    SignSketch(size_t d, unsigned seed = 2023): d(d) {
+        init_dim();
+        signs.resize(3 * D);
+        std::srand(seed);
+        for (auto& s : signs) s = std::rand() % 2 ? 1.0f : -1.0f;
+    }
+
+    void init_dim() {
+        D = 1;
+        while (D < d) D <<= 1;
+        words = (D + 63) / 64;
+    }
+
+    // cosine of the angle estimate lowered by z standard deviations, indexed by Hamming distance
+    void init_bounds(float z) {
+        cos_lo.resize(D + 1);
+        for (size_t h = 0; h <= D; h++) {
+            double p = (double)h / D;
+            double sigma = M_PI * std::sqrt(std::max(p * (1 - p), 1.0 / D) / D);
+            double theta = std::max(0.0, M_PI * p - z * sigma);
+            cos_lo[h] = std::cos(theta);
+        }
+    }
+
+    static void fwht(float* x, size_t n) {
+        for (size_t h = 1; h < n; h <<= 1) {
+            for (size_t i = 0; i < n; i += h << 1) {
+                for (size_t j = i; j < i + h; j++) {
+                    float a = x[j], b = x[j + h];
+                    x[j] = a + b;
+                    x[j + h] = a - b;
+                }
+            }
+        }
+    }
+
+    // out holds D floats, returns the norm of the residual x - c
+    float encode(const float* x, const float* c, float* out, uint64_t* code) const {
+        float norm = 0;
+        for (size_t i = 0; i < d; i++) {
+            out[i] = x[i] - c[i];
+            norm += out[i] * out[i];
+        }
+        for (size_t i = d; i < D; i++) out[i] = 0;
+        float scale = 1 / std::sqrt((float)D);
+        for (size_t r = 0; r < 3; r++) {
+            for (size_t i = 0; i < D; i++) out[i] *= signs[r * D + i];
+            fwht(out, D);
+            for (size_t i = 0; i < D; i++) out[i] *= scale;
+        }
+        for (size_t w = 0; w < words; w++) code[w] = 0;
+        for (size_t i = 0; i < D; i++) {
+            if (out[i] >= 0) code[i / 64] |= 1ull << (i % 64);
+        }
+        return std::sqrt(norm);
+    }
+
+    inline float lower_bound(const uint64_t* code1, float norm1, const uint64_t* code2, float norm2) const {
+        size_t h = 0;
+        for (size_t w = 0; w < words; w++) h += __builtin_popcountll(code1[w] ^ code2[w]);
+        return norm1 * norm1 + norm2 * norm2 - 2 * norm1 * norm2 * cos_lo[h];
+    }
+};
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <string>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <omp.h>
+
+// Collects the join result with one counter slot per thread, so emitting needs no
+// synchronization. Besides the number of pairs it counts how often the sampled ids
+// (every 100000th point) appear, which is what the recall estimate is based on.
+//
+// With an output file the pairs themselves are kept too: every thread appends to its own
+// chunks of a huge page backed arena without synchronizing, and only a full chunk is handed
+// over, by queueing its index for a writer thread that sleeps until there is one. A thread
+// whose next chunk is still being written sleeps until the writer frees it.
+//
+// When exact duplicates were collapsed at build time, every id handed to the sink stands
+// for its whole group and each pair is expanded to the members of both groups.
+struct ResultSink {
+    static const size_t CHUNK_BYTES = 2 << 20;
+    static const size_t CHUNK_PAIRS = CHUNK_BYTES / (2 * sizeof(size_t));
+    static const size_t CHUNKS_PER_THREAD = 4;
+
+    struct Counter {
+        size_t pairs;
+        size_t sampled;
+        size_t active;
+        size_t pad[5];
+    };
+
+    // full is set by the owning thread when it queues the chunk and cleared by the writer,
+    // both under the mutex
+    struct Chunk {
+        bool full;
+        size_t used;
+        size_t* pairs;
+    };
+
+    std::vector<Counter> counters;
+    bool output;
+    int fd;
+    char* arena;
+    size_t arena_size;
+    std::unique_ptr<Chunk[]> chunks;
+    std::deque<size_t> queue;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::condition_variable freed;
+    size_t waiting;
+    bool done;
+    std::thread writer;
+    const size_t* group_offset;
+    const size_t* group_ids;
+
+    ResultSink(): counters(omp_get_max_threads(), Counter{0, 0, 0, {}}), output(false), fd(-1), arena(nullptr),
+        group_offset(nullptr), group_ids(nullptr) {}
+
+    void set_groups(const size_t* offset, const size_t* ids) {
+        group_offset = offset;
+        group_ids = ids;
+    }
+
+    inline size_t group_size(size_t id) {
+        return group_offset[id + 1] - group_offset[id];
+    }
+
+    inline const size_t* group(size_t id) {
+        return group_ids + group_offset[id];
+    }
+
+    void open(std::string file) {
+        fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            std::cout << "open output file error" << std::endl;
+            exit(-1);
+        }
+        size_t chunk_num = counters.size() * CHUNKS_PER_THREAD;
+        arena_size = chunk_num * CHUNK_BYTES;
+        void* p = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            p = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                std::cout << "allocate output arena error" << std::endl;
+                exit(-1);
+            }
+            madvise(p, arena_size, MADV_HUGEPAGE);
+        }
+        arena = (char*)p;
+        chunks.reset(new Chunk[chunk_num]);
+        for (size_t i = 0; i < chunk_num; i++) {
+            chunks[i].full = false;
+            chunks[i].used = 0;
+            chunks[i].pairs = (size_t*)(arena + i * CHUNK_BYTES);
+        }
+        output = true;
+        waiting = 0;
+        done = false;
+        writer = std::thread(&ResultSink::write_loop, this);
+    }
+
+    // hands out the remaining partial chunks and waits until everything is written
+    void close() {
+        if (!output) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < counters.size() * CHUNKS_PER_THREAD; i++) {
+                if (!chunks[i].full && chunks[i].used > 0) {
+                    chunks[i].full = true;
+                    queue.push_back(i);
+                }
+            }
+            done = true;
+        }
+        queued.notify_one();
+        writer.join();
+        ::close(fd);
+        munmap(arena, arena_size);
+        output = false;
+    }
+
+    ~ResultSink() {
+        close();
+    }
+
+    void write_loop() {
+        while (true) {
+            size_t i;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [&] { return done || !queue.empty(); });
+                if (queue.empty()) return;
+                i = queue.front();
+                queue.pop_front();
+            }
+            auto& ch = chunks[i];
+            const char* buf = (const char*)ch.pairs;
+            size_t left = ch.used * 2 * sizeof(size_t);
+            while (left > 0) {
+                auto count = ::write(fd, buf, left);
+                if (count <= 0) {
+                    std::cout << "write output file error" << std::endl;
+                    exit(-1);
+                }
+                buf += count;
+                left -= count;
+            }
+            ch.used = 0;
+            std::lock_guard<std::mutex> lock(mutex);
+            ch.full = false;
+            if (waiting > 0) freed.notify_all();
+        }
+    }
+
+    inline void append(Counter& c, size_t id1, size_t id2) {
+        size_t t = &c - counters.data();
+        Chunk* ch = &chunks[t * CHUNKS_PER_THREAD + c.active];
+        ch->pairs[2 * ch->used] = id1;
+        ch->pairs[2 * ch->used + 1] = id2;
+        if (++ch->used < CHUNK_PAIRS) return;
+        handoff(c, t);
+    }
+
+    // queues the full active chunk of thread t and moves on to its next one, waiting for
+    // the writer if that one is still queued
+    void handoff(Counter& c, size_t t) {
+        size_t i = t * CHUNKS_PER_THREAD + c.active;
+        c.active = (c.active + 1) % CHUNKS_PER_THREAD;
+        Chunk* next = &chunks[t * CHUNKS_PER_THREAD + c.active];
+        std::unique_lock<std::mutex> lock(mutex);
+        chunks[i].full = true;
+        queue.push_back(i);
+        queued.notify_one();
+        if (next->full) {
+            waiting++;
+            freed.wait(lock, [&] { return !next->full; });
+            waiting--;
+        }
+    }
+
+    // total group size and number of sampled members of the groups of ids
+    inline void weigh(const size_t* ids, size_t n, size_t& w, size_t& s) {
+        for (size_t i = 0; i < n; i++) {
+            size_t wi = group_size(ids[i]);
+            w += wi;
+            s += count_sampled(group(ids[i]), wi);
+        }
+    }
+
+    // appends the member pairs of two groups without counting them
+    inline void expand(Counter& c, size_t id1, size_t id2) {
+        for (size_t i = 0; i < group_size(id1); i++) {
+            for (size_t j = 0; j < group_size(id2); j++) append(c, group(id1)[i], group(id2)[j]);
+        }
+    }
+
+    static inline bool is_sampled(size_t id) {
+        return id % 100000 == 0;
+    }
+
+    static inline size_t count_sampled(const size_t* ids, size_t n) {
+        size_t s = 0;
+        for (size_t i = 0; i < n; i++) s += is_sampled(ids[i]);
+        return s;
+    }
+
+    // every pair of members of both groups
+    inline void emit_groups(Counter& c, size_t id1, size_t id2) {
+        size_t n1 = group_size(id1), n2 = group_size(id2);
+        c.pairs += n1 * n2;
+        c.sampled += count_sampled(group(id1), n1) * n2 + count_sampled(group(id2), n2) * n1;
+        if (output) expand(c, id1, id2);
+    }
+
+    // the pairs within the group of a representative, all at distance 0
+    inline void emit_group(size_t id) {
+        auto& c = counters[omp_get_thread_num()];
+        size_t n = group_size(id);
+        if (n < 2) return;
+        c.pairs += n * (n - 1) / 2;
+        c.sampled += count_sampled(group(id), n) * (n - 1);
+        if (!output) return;
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = i + 1; j < n; j++) append(c, group(id)[i], group(id)[j]);
+        }
+    }
+
+    inline void emit(size_t id1, size_t id2) {
+        auto& c = counters[omp_get_thread_num()];
+        if (group_offset) {
+            emit_groups(c, id1, id2);
+            return;
+        }
+        c.pairs++;
+        c.sampled += is_sampled(id1) + is_sampled(id2);
+        if (output) append(c, id1, id2);
+    }
+
+    // the pairs (id1, ids2[t]) for every bit t of mask
+    inline void emit_mask(size_t id1, const size_t* ids2, uint32_t mask) {
+        auto& c = counters[omp_get_thread_num()];
+        if (group_offset) {
+            for (; mask; mask &= mask - 1) emit_groups(c, id1, ids2[__builtin_ctz(mask)]);
+            return;
+        }
+        size_t count = __builtin_popcount(mask);
+        c.pairs += count;
+        c.sampled += is_sampled(id1) * count;
+        for (; mask; mask &= mask - 1) {
+            auto id2 = ids2[__builtin_ctz(mask)];
+            c.sampled += is_sampled(id2);
+            if (output) append(c, id1, id2);
+        }
+    }
+
+    // every pair of ids1 x ids2
+    inline void emit_cross(const size_t* ids1, size_t n1, const size_t* ids2, size_t n2) {
+        auto& c = counters[omp_get_thread_num()];
+        if (group_offset) {
+            size_t w1 = 0, s1 = 0, w2 = 0, s2 = 0;
+            weigh(ids1, n1, w1, s1);
+            weigh(ids2, n2, w2, s2);
+            c.pairs += w1 * w2;
+            c.sampled += s1 * w2 + s2 * w1;
+            if (!output) return;
+            for (size_t i = 0; i < n1; i++) {
+                for (size_t j = 0; j < n2; j++) expand(c, ids1[i], ids2[j]);
+            }
+            return;
+        }
+        c.pairs += n1 * n2;
+        c.sampled += count_sampled(ids1, n1) * n2 + count_sampled(ids2, n2) * n1;
+        if (!output) return;
+        for (size_t i = 0; i < n1; i++) {
+            for (size_t j = 0; j < n2; j++) append(c, ids1[i], ids2[j]);
+        }
+    }
+
+    // every unordered pair within ids
+    inline void emit_all(const size_t* ids, size_t n) {
+        if (n < 2) return;
+        auto& c = counters[omp_get_thread_num()];
+        if (group_offset) {
+            // pairs between different groups only, those within a group are emitted once
+            // by emit_group
+            size_t w = 0, s = 0, w2 = 0, sw = 0;
+            for (size_t i = 0; i < n; i++) {
+                size_t wi = group_size(ids[i]), si = count_sampled(group(ids[i]), wi);
+                w += wi;
+                s += si;
+                w2 += wi * wi;
+                sw += si * wi;
+            }
+            c.pairs += (w * w - w2) / 2;
+            c.sampled += s * w - sw;
+            if (!output) return;
+            for (size_t i = 0; i < n; i++) {
+                for (size_t j = i + 1; j < n; j++) expand(c, ids[i], ids[j]);
+            }
+            return;
+        }
+        c.pairs += n * (n - 1) / 2;
+        c.sampled += count_sampled(ids, n) * (n - 1);
+        if (!output) return;
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = i + 1; j < n; j++) append(c, ids[i], ids[j]);
+        }
+    }
+
+    size_t pairs() {
+        size_t s = 0;
+        for (auto& c : counters) s += c.pairs;
+        return s;
+    }
+
+    size_t sampled() {
+        size_t s = 0;
+        for (auto& c : counters) s += c.sampled;
+        return s;
+    }
+};
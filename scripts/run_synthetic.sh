@@ -0,0 +1,15 @@
+# 32-d synthetic set, created with
+# python datasets/create_dataset.py --dataset synthetic-32d
+# Each run builds and joins; compare the "read requests", "bytes read ... amplification"
+# and "Join done" time lines of the output.
+
+# baseline; run it on two commits to compare the cache policy
+./build/main configs/synthetic32_R450.config
+./build/main configs/synthetic32_R2500.config
+
+# page-aligned cluster extents; compare the amplification with the baseline above
+./build/main configs/synthetic32_R450_align.config
+
+# interleaved (AoSoA) layout; the join phase is the "Join done" time minus the "Build done" time
+./build/main configs/synthetic32_R450_interleave.config
+./build/main configs/synthetic32_R2500_interleave.config
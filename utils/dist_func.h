@@ -5,8 +5,10 @@
 #pragma once
 
 #include "dist_header.h"
+#include "half.h"
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 
 namespace utils{
 
@@ -635,4 +637,176 @@ static float AbsInnerProductSIMD(const void *pVec1, const void *pVec2, const voi
     }
 
 
+    // pVec1 is fp32, pVec2 is stored as fp16
+    static float L2SqrFloatHalf(const void *pVec1v, const void *pVec2v, const void *dim_ptr) {
+        float *pVec1 = (float *) pVec1v;
+        uint16_t *pVec2 = (uint16_t *) pVec2v;
+        std::size_t dim = *((std::size_t *) dim_ptr);
+
+        float res = 0;
+    #if defined(USE_AVX) && defined(__F16C__)
+        __m256 sum256 = _mm256_setzero_ps();
+        while (dim >= 8) {
+            __m256 mx256 = _mm256_loadu_ps(pVec1); pVec1 += 8;
+            __m256 my256 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) pVec2)); pVec2 += 8;
+            __m256 diff256 = _mm256_sub_ps(mx256, my256);
+            sum256 = _mm256_fmadd_ps(diff256, diff256, sum256);
+            dim -= 8;
+        }
+        res = HsumFloat128(_mm_add_ps(_mm256_castps256_ps128(sum256), _mm256_extractf128_ps(sum256, 1)));
+    #endif
+        for (std::size_t i = 0; i < dim; ++i) {
+            float diff = pVec1[i] - HalfToFloat(pVec2[i]);
+            res += diff * diff;
+        }
+        return res;
+    }
+
+    // pVec1 is fp32, pVec2 is stored as bf16
+    static float L2SqrFloatBf16(const void *pVec1v, const void *pVec2v, const void *dim_ptr) {
+        float *pVec1 = (float *) pVec1v;
+        uint16_t *pVec2 = (uint16_t *) pVec2v;
+        std::size_t dim = *((std::size_t *) dim_ptr);
+
+        float res = 0;
+    #if defined(USE_AVX) && defined(__AVX2__)
+        __m256 sum256 = _mm256_setzero_ps();
+        while (dim >= 8) {
+            __m256 mx256 = _mm256_loadu_ps(pVec1); pVec1 += 8;
+            __m256i y256 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) pVec2)); pVec2 += 8;
+            __m256 my256 = _mm256_castsi256_ps(_mm256_slli_epi32(y256, 16));
+            __m256 diff256 = _mm256_sub_ps(mx256, my256);
+            sum256 = _mm256_fmadd_ps(diff256, diff256, sum256);
+            dim -= 8;
+        }
+        res = HsumFloat128(_mm_add_ps(_mm256_castps256_ps128(sum256), _mm256_extractf128_ps(sum256, 1)));
+    #endif
+        for (std::size_t i = 0; i < dim; ++i) {
+            float diff = pVec1[i] - Bf16ToFloat(pVec2[i]);
+            res += diff * diff;
+        }
+        return res;
+    }
+
+    // distances from pVec to m vectors stored contiguously at pVecs
+    static void L2SqrBatch(const float *pVec, const float *pVecs, std::size_t m, std::size_t dim, float *out) {
+        for (std::size_t i = 0; i < m; ++i) {
+            out[i] = L2Sqr(pVec, pVecs + i * dim, &dim);
+        }
+    }
+
+    // distances from pVec to the 16 points of an interleaved group, in which dimension k of
+    // point t is at pGroup[k * 16 + t]; one lane per point, so no horizontal sums are needed
+    static void L2SqrInterleaved16(const float *pVec, const float *pGroup, std::size_t dim, float *out) {
+    #if defined(USE_AVX512)
+        __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+        std::size_t k = 0;
+        for (; k + 2 <= dim; k += 2) {
+            __m512 diff0 = _mm512_sub_ps(_mm512_set1_ps(pVec[k]), _mm512_loadu_ps(pGroup + k * 16));
+            __m512 diff1 = _mm512_sub_ps(_mm512_set1_ps(pVec[k + 1]), _mm512_loadu_ps(pGroup + (k + 1) * 16));
+            sum0 = _mm512_fmadd_ps(diff0, diff0, sum0);
+            sum1 = _mm512_fmadd_ps(diff1, diff1, sum1);
+        }
+        if (k < dim) {
+            __m512 diff0 = _mm512_sub_ps(_mm512_set1_ps(pVec[k]), _mm512_loadu_ps(pGroup + k * 16));
+            sum0 = _mm512_fmadd_ps(diff0, diff0, sum0);
+        }
+        _mm512_storeu_ps(out, _mm512_add_ps(sum0, sum1));
+    #else
+        for (std::size_t t = 0; t < 16; ++t) out[t] = 0;
+        for (std::size_t k = 0; k < dim; ++k) {
+#pragma omp simd
+            for (std::size_t t = 0; t < 16; ++t) {
+                float diff = pVec[k] - pGroup[k * 16 + t];
+                out[t] += diff * diff;
+            }
+        }
+    #endif
+    }
+
+    // bit t is set if dist[t] < bound, or dist[t] <= bound with or_equal
+    static inline uint32_t LessMask16(const float *dist, float bound, bool or_equal = false) {
+    #if defined(USE_AVX512)
+        __m512 d512 = _mm512_loadu_ps(dist), b512 = _mm512_set1_ps(bound);
+        return or_equal ? _mm512_cmp_ps_mask(d512, b512, _CMP_LE_OQ) : _mm512_cmp_ps_mask(d512, b512, _CMP_LT_OQ);
+    #else
+        uint32_t mask = 0;
+        for (std::size_t t = 0; t < 16; ++t) mask |= (uint32_t)(or_equal ? dist[t] <= bound : dist[t] < bound) << t;
+        return mask;
+    #endif
+    }
+
+    // squared distance between two axis-aligned boxes, 0 if they overlap
+    static float BoxL2Sqr(const float *lo1, const float *hi1, const float *lo2, const float *hi2, std::size_t dim) {
+        float res = 0;
+#pragma omp simd reduction(+:res)
+        for (std::size_t i = 0; i < dim; ++i) {
+            float gap = std::max(std::max(lo2[i] - hi1[i], lo1[i] - hi2[i]), 0.0f);
+            res += gap * gap;
+        }
+        return res;
+    }
+
+    // squared distance from a point to an axis-aligned box, 0 if it lies inside
+    static float PointBoxL2Sqr(const float *pVec, const float *lo, const float *hi, std::size_t dim) {
+        float res = 0;
+#pragma omp simd reduction(+:res)
+        for (std::size_t i = 0; i < dim; ++i) {
+            float gap = std::max(std::max(lo[i] - pVec[i], pVec[i] - hi[i]), 0.0f);
+            res += gap * gap;
+        }
+        return res;
+    }
+
+    typedef float (*DistFunc)(const void *, const void *, const void *);
+
+    // accumulates func over chunks of the dimensions and stops once the partial sum reaches
+    // bound, in which case the result is only a lower bound of the distance
+    static float L2SqrAbandon(DistFunc func, const float *pVec1, const char *pVec2, std::size_t dim,
+                              std::size_t elem_size, std::size_t chunk, float bound) {
+        float res = 0;
+    #if defined(USE_AVX512)
+        if (elem_size == sizeof(float)) {
+            const float *pVec2f = (const float *) pVec2;
+            __m512 sum512 = _mm512_setzero_ps();
+            float PORTABLE_ALIGN64 TmpRes[16];
+            auto reduce = [&]() -> float {
+                _mm512_store_ps(TmpRes, sum512);
+                float s = 0;
+                for (int t = 0; t < 16; t++) s += TmpRes[t];
+                return s;
+            };
+            std::size_t i = 0, next = chunk;
+            while (i + 16 <= dim) {
+                __m512 diff512 = _mm512_sub_ps(_mm512_loadu_ps(pVec1 + i), _mm512_loadu_ps(pVec2f + i));
+                sum512 = _mm512_fmadd_ps(diff512, diff512, sum512);
+                i += 16;
+                if (i >= next) {
+                    res = reduce();
+                    if (res >= bound) return res;
+                    next = i + chunk;
+                }
+            }
+            res = reduce();
+            for (; i < dim; ++i) {
+                float diff = pVec1[i] - pVec2f[i];
+                res += diff * diff;
+            }
+            return res;
+        }
+    #endif
+        for (std::size_t i = 0; i < dim && res < bound; i += chunk) {
+            std::size_t len = std::min(chunk, dim - i);
+            res += func(pVec1 + i, pVec2 + i * elem_size, &len);
+        }
+        return res;
+    }
+
+    // distance between an fp32 vector and a vector in the given storage format
+    static DistFunc L2SqrStored(Storage storage) {
+        if (storage == STORAGE_FP16) return L2SqrFloatHalf;
+        if (storage == STORAGE_BF16) return L2SqrFloatBf16;
+        return L2Sqr;
+    }
+
 } // namespace utils
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <iostream>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace utils {
+
+enum Storage {
+    STORAGE_FP32 = 0,
+    STORAGE_FP16 = 1,
+    STORAGE_BF16 = 2,
+};
+
+static Storage parse_storage(const std::string& name) {
+    if (name == "fp32") return STORAGE_FP32;
+    if (name == "fp16") return STORAGE_FP16;
+    if (name == "bf16") return STORAGE_BF16;
+    std::cout << "unknown storage type: " << name << std::endl;
+    exit(-1);
+}
+
+static size_t storage_elem_size(Storage storage) {
+    return storage == STORAGE_FP32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+static inline uint16_t FloatToHalf(float x) {
+#if defined(__F16C__)
+    return _cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT);
+#else
+    uint32_t u;
+    memcpy(&u, &x, 4);
+    uint32_t sign = (u >> 16) & 0x8000;
+    int32_t exp = ((u >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = u & 0x7fffff;
+    if (((u >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 31) return sign | 0x7c00;
+    if (exp <= 0) {
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1))) half++;
+        return sign | half;
+    }
+    uint32_t half = sign | (exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) half++;
+    return half;
+#endif
+}
+
+static inline float HalfToFloat(uint16_t h) {
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t u;
+    if (exp == 0x1f) {
+        u = sign | 0x7f800000 | (mant << 13);
+    } else if (exp == 0) {
+        if (mant == 0) {
+            u = sign;
+        } else {
+            exp = 127 - 15 + 1;
+            while (!(mant & 0x400)) { mant <<= 1; exp--; }
+            u = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else {
+        u = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+    float x;
+    memcpy(&x, &u, 4);
+    return x;
+#endif
+}
+
+static inline uint16_t FloatToBf16(float x) {
+    uint32_t u;
+    memcpy(&u, &x, 4);
+    if ((u & 0x7fffffff) > 0x7f800000) return (u >> 16) | 0x40;
+    u += 0x7fff + ((u >> 16) & 1);
+    return u >> 16;
+}
+
+static inline float Bf16ToFloat(uint16_t h) {
+    uint32_t u = (uint32_t)h << 16;
+    float x;
+    memcpy(&x, &u, 4);
+    return x;
+}
+
+// convert d floats to the given storage format, dst holds d * storage_elem_size bytes
+static void encode_vector(const float* src, void* dst, size_t d, Storage storage) {
+    if (storage == STORAGE_FP32) {
+        memcpy(dst, src, d * sizeof(float));
+    } else if (storage == STORAGE_FP16) {
+        uint16_t* out = (uint16_t*)dst;
+        for (size_t i = 0; i < d; i++) out[i] = FloatToHalf(src[i]);
+    } else {
+        uint16_t* out = (uint16_t*)dst;
+        for (size_t i = 0; i < d; i++) out[i] = FloatToBf16(src[i]);
+    }
+}
+
+static void decode_vector(const void* src, float* dst, size_t d, Storage storage) {
+    if (storage == STORAGE_FP32) {
+        memcpy(dst, src, d * sizeof(float));
+    } else if (storage == STORAGE_FP16) {
+        const uint16_t* in = (const uint16_t*)src;
+        for (size_t i = 0; i < d; i++) dst[i] = HalfToFloat(in[i]);
+    } else {
+        const uint16_t* in = (const uint16_t*)src;
+        for (size_t i = 0; i < d; i++) dst[i] = Bf16ToFloat(in[i]);
+    }
+}
+
+} // namespace utils
@@ -73,6 +73,17 @@ public:
         }
     }
     
+    [[gnu::hot]] inline void remove(TObj target) {
+        auto location = positions.find(target);
+        if (location == positions.end()) return;
+        unsigned crawler = location->second;
+        positions.erase(location);
+        if (crawler == --current_bound) return;
+        storage[crawler] = storage[current_bound];
+        if (parent_pos(crawler) && comparator(storage[crawler].second, parent(crawler).second)) sift_up(crawler);
+        else sift_down(crawler);
+    }
+
     void run_diagnostic() {
         for (int i = 1; i < current_bound; ++i) {
             std::cout << storage[i].first << " " << storage[i].second << std::endl;
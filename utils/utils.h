@@ -7,9 +7,14 @@
 #include <queue>
 #include <array>
 #include <fcntl.h>
+#include <unistd.h>
 #include <filesystem>
 #include <linux/mman.h>
 #include <memory>
+#include <cstring>
+#include <cstdint>
+
+#define PAGE_SIZE 4096
 
 typedef std::priority_queue<std::pair<float, unsigned>> candidate_pool;
 
@@ -68,4 +73,40 @@ void read_fvecs(char* filename, float*& data, unsigned& n, unsigned& d) {
 
 size_t div_round_up(size_t x, size_t y) {
     return (x / y) + static_cast<size_t>((x % y) != 0);
-}
\ No newline at end of file
+}
+
+// flushes a file (or a directory, after renames in it) to the device
+bool sync_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// 64-bit hash of a byte string in the style of xxHash64 (multiply-rotate rounds over 8-byte
+// words, then an avalanche); callers still compare the bytes to resolve collisions
+uint64_t hash_bytes(const char* data, size_t len, uint64_t seed = 0) {
+    const uint64_t p1 = 0x9E3779B185EBCA87ull, p2 = 0xC2B2AE3D27D4EB4Full, p3 = 0x165667B19E3779F9ull;
+    uint64_t h = seed + p3 + len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        w *= p2;
+        w = (w << 31) | (w >> 33);
+        w *= p1;
+        h ^= w;
+        h = ((h << 27) | (h >> 37)) * p1 + p3;
+    }
+    for (; i < len; i++) {
+        h ^= (uint8_t)data[i] * p3;
+        h = ((h << 11) | (h >> 53)) * p1;
+    }
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+}